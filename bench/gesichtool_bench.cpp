@@ -0,0 +1,285 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Microbenchmarks for the expensive steps of the pipeline on
+// synthetic images, so that results are comparable across OpenCV and
+// dlib versions without a corpus. bench/run_corpus.sh covers the end
+// to end throughput on real images.
+
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/opencv.h>
+#include <fmt/format.h>
+#include <opencv2/opencv.hpp>
+
+#include "dedup_index.hpp"
+#include "face_extractor.hpp"
+#include "image_header.hpp"
+#include "imaging.hpp"
+#include "output_sink.hpp"
+
+namespace gesichtool {
+namespace {
+
+// A smooth gradient with noise on top compresses about like a photo,
+// unlike pure noise or a flat color
+cv::Mat make_image(int width, int height)
+{
+  cv::Mat image(height, width, CV_8UC3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      image.at<cv::Vec3b>(y, x) = cv::Vec3b(static_cast<unsigned char>(x * 255 / width),
+                                            static_cast<unsigned char>(y * 255 / height),
+                                            static_cast<unsigned char>((x + y) * 127 / (width + height)));
+    }
+  }
+
+  cv::Mat noise(image.size(), image.type());
+  cv::theRNG().state = 12345;
+  cv::randn(noise, cv::Scalar::all(0), cv::Scalar::all(12));
+  return image + noise;
+}
+
+std::vector<unsigned char> encode(cv::Mat const& image, std::string const& extension)
+{
+  std::vector<unsigned char> data;
+  cv::imencode(extension, image, data);
+  return data;
+}
+
+// from VGA up to a 12 megapixel phone photo
+void image_sizes(benchmark::internal::Benchmark* bench)
+{
+  bench->Args({640, 480})->Args({1920, 1080})->Args({4032, 3024});
+}
+
+void BM_ReadImageSize(benchmark::State& state)
+{
+  std::vector<unsigned char> const data = encode(make_image(640, 480), ".jpg");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(read_image_size(data));
+  }
+}
+BENCHMARK(BM_ReadImageSize);
+
+// the detection decode with --detect-scale 1, 2, 4 and 8
+void BM_DecodeGrayscale(benchmark::State& state)
+{
+  static int const flags[] = { cv::IMREAD_GRAYSCALE, cv::IMREAD_REDUCED_GRAYSCALE_2,
+                               cv::IMREAD_REDUCED_GRAYSCALE_4, cv::IMREAD_REDUCED_GRAYSCALE_8 };
+
+  std::vector<unsigned char> const data = encode(make_image(4032, 3024), ".jpg");
+  int const flag = flags[state.range(0)];
+  cv::Mat image;
+  for (auto _ : state) {
+    cv::imdecode(data, flag, &image);
+    benchmark::DoNotOptimize(image.data);
+  }
+  state.SetLabel(fmt::format("1/{}", 1 << state.range(0)));
+}
+BENCHMARK(BM_DecodeGrayscale)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+void BM_DecodeColor(benchmark::State& state)
+{
+  std::vector<unsigned char> const data = encode(make_image(static_cast<int>(state.range(0)),
+                                                            static_cast<int>(state.range(1))), ".jpg");
+  cv::Mat image;
+  for (auto _ : state) {
+    cv::imdecode(data, cv::IMREAD_COLOR, &image);
+    benchmark::DoNotOptimize(image.data);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeColor)->Apply(image_sizes)->Unit(benchmark::kMillisecond);
+
+// the crop_faces() extract_faces() does for every image, from 8 faces
+// on the crops are done in parallel
+void BM_ExtractFaces(benchmark::State& state)
+{
+  cv::Mat const image = make_image(4032, 3024);
+  std::vector<Face> faces;
+  for (int idx = 0; idx < static_cast<int>(state.range(0)); ++idx) {
+    faces.push_back(Face{cv::Rect(100 + idx * 300, 500, 600, 600) & cv::Rect(0, 0, image.cols, image.rows), 0.0});
+  }
+
+  cv::Mat tensor;
+  for (auto _ : state) {
+    cv::Mat const crops = crop_faces(image, faces, 0.0, cv::Size(512, 512), tensor);
+    benchmark::DoNotOptimize(crops.data);
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(faces.size()));
+}
+BENCHMARK(BM_ExtractFaces)->Arg(1)->Arg(4)->Arg(12)->Unit(benchmark::kMillisecond);
+
+// inflated crops that reach past the image border, these are padded
+// with black and resampled by a single cv::warpAffine()
+void BM_ExtractFacesPadded(benchmark::State& state)
+{
+  cv::Mat const image = make_image(4032, 3024);
+  std::vector<Face> faces;
+  for (int idx = 0; idx < static_cast<int>(state.range(0)); ++idx) {
+    faces.push_back(Face{cv::Rect(idx * 300, 0, 600, 600) & cv::Rect(0, 0, image.cols, image.rows), 0.0});
+  }
+
+  cv::Mat tensor;
+  for (auto _ : state) {
+    cv::Mat const crops = crop_faces(image, faces, 0.5, cv::Size(512, 512), tensor);
+    benchmark::DoNotOptimize(crops.data);
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(faces.size()));
+}
+BENCHMARK(BM_ExtractFacesPadded)->Arg(1)->Arg(4)->Arg(12)->Unit(benchmark::kMillisecond);
+
+void BM_Encode(benchmark::State& state)
+{
+  static char const* const extensions[] = { ".jpg", ".png", ".webp" };
+
+  cv::Mat const crop = make_image(512, 512);
+  std::string const extension = extensions[state.range(0)];
+  std::vector<unsigned char> data;
+  for (auto _ : state) {
+    cv::imencode(extension, crop, data);
+    benchmark::DoNotOptimize(data.data());
+  }
+  state.SetLabel(extension);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Encode)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+void BM_TarSinkWrite(benchmark::State& state)
+{
+  std::filesystem::path const directory = std::filesystem::temp_directory_path() / "gesichtool_bench";
+  std::filesystem::create_directories(directory);
+
+  std::vector<unsigned char> const data = encode(make_image(512, 512), ".jpg");
+  {
+    TarSink sink(directory, "bench", uint64_t{1} << 30, false);
+    size_t idx = 0;
+    for (auto _ : state) {
+      sink.write(fmt::format("face{:06d}.jpg", idx++), data, {});
+    }
+    sink.finish();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * data.size()));
+
+  std::filesystem::remove_all(directory);
+}
+BENCHMARK(BM_TarSinkWrite);
+
+// Inserts into an index of range(1) random hashes at the largest
+// --dedup distance, every other hash is a near-duplicate of a known one
+// and must be rejected
+void BM_DedupIndexInsert(benchmark::State& state)
+{
+  int const distance = DedupIndex::kMaxDistance;
+  DedupIndex index(distance, {});
+
+  // random hashes can already be near-duplicates of each other at this
+  // distance, only the ones the index kept are known
+  std::mt19937_64 rng(12345);
+  std::vector<uint64_t> known;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    uint64_t const hash = rng();
+    if (index.insert(hash)) {
+      known.push_back(hash);
+    }
+  }
+
+  size_t idx = 0;
+  for (auto _ : state) {
+    if (idx++ % 2 == 0) {
+      benchmark::DoNotOptimize(index.insert(rng()));
+    } else {
+      uint64_t hash = known[rng() % known.size()];
+      for (int i = 0; i < distance; ++i) {
+        hash ^= uint64_t{1} << (rng() % 64);
+      }
+      if (index.insert(hash)) {
+        state.SkipWithError("near-duplicate was not rejected");
+        break;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DedupIndexInsert)->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+void BM_DetectDlib(benchmark::State& state)
+{
+  cv::Mat gray;
+  cv::cvtColor(make_image(static_cast<int>(state.range(0)), static_cast<int>(state.range(1))),
+               gray, cv::COLOR_BGR2GRAY);
+  dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+  dlib::cv_image<unsigned char> const dlib_image(gray);
+
+  for (auto _ : state) {
+    std::vector<dlib::rect_detection> faces;
+    detector(dlib_image, faces, 0.0);
+    benchmark::DoNotOptimize(faces.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DetectDlib)->Args({640, 480})->Args({1920, 1080})->Unit(benchmark::kMillisecond);
+
+void BM_DetectOpenCV(benchmark::State& state)
+{
+  cv::Mat gray;
+  cv::cvtColor(make_image(static_cast<int>(state.range(0)), static_cast<int>(state.range(1))),
+               gray, cv::COLOR_BGR2GRAY);
+
+  cv::CascadeClassifier cascade(cv::samples::findFile("haarcascades/haarcascade_frontalface_default.xml"));
+  if (cascade.empty()) {
+    state.SkipWithError("failed to load the face cascade");
+    return;
+  }
+
+  for (auto _ : state) {
+    std::vector<cv::Rect> faces;
+    cascade.detectMultiScale(gray, faces, 1.1, 3, 0, cv::Size(64, 64));
+    benchmark::DoNotOptimize(faces.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DetectOpenCV)->Apply(image_sizes)->Unit(benchmark::kMillisecond);
+
+// the whole in-process API with the default options, the test image
+// has no faces so this is decode plus detection
+void BM_FaceExtractorProcess(benchmark::State& state)
+{
+  std::vector<unsigned char> const data = encode(make_image(static_cast<int>(state.range(0)),
+                                                            static_cast<int>(state.range(1))), ".jpg");
+  Options const opts;
+  FaceExtractor extractor(opts);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(extractor.process(data));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FaceExtractorProcess)->Args({640, 480})->Args({1920, 1080})->Unit(benchmark::kMillisecond);
+
+} // namespace
+} // namespace gesichtool
+
+BENCHMARK_MAIN();
+
+/* EOF */
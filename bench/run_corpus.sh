@@ -0,0 +1,49 @@
+#!/bin/sh
+# Runs gesichtool over a fixed corpus for every detection mode and a
+# range of thread counts and prints the images/s from --stats, e.g.:
+#
+#   bench/run_corpus.sh build/gesichtool ~/corpus/faces-1000
+#
+# GESICHTOOL_BENCH_JOBS overrides the thread counts, set
+# GESICHTOOL_BENCH_DNN and GESICHTOOL_BENCH_DLIB_CNN to model files to
+# include those modes.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 GESICHTOOL CORPUS_DIR [ARGS...]" >&2
+  exit 1
+fi
+
+gesichtool="$1"
+corpus="$2"
+shift 2
+
+jobs="${GESICHTOOL_BENCH_JOBS:-1 2 4 $(nproc)}"
+
+output="$(mktemp -d)"
+trap 'rm -rf "$output"' EXIT
+
+run() {
+  mode="$1"
+  shift
+  for j in $jobs; do
+    rm -rf "$output/faces"
+    rate="$("$gesichtool" "$@" -j "$j" --stats -o "$output/faces" "$corpus" \
+              | sed -n 's/.* \([0-9.]*\) images\/s.*/\1/p')"
+    printf '%-10s %4s jobs %10s images/s\n' "$mode" "$j" "$rate"
+  done
+}
+
+run dlib --dlib "$@"
+run opencv --opencv "$@"
+
+if [ -n "$GESICHTOOL_BENCH_DNN" ]; then
+  run dnn --dnn "$GESICHTOOL_BENCH_DNN" "$@"
+fi
+
+if [ -n "$GESICHTOOL_BENCH_DLIB_CNN" ]; then
+  run dlib-cnn --dlib-cnn "$GESICHTOOL_BENCH_DLIB_CNN" "$@"
+fi
+
+# EOF #
@@ -31,6 +31,16 @@
               libjpeg
             ];
           };
+
+          gesichtool-bench = gesichtool.overrideAttrs (old: {
+            pname = "gesichtool-bench";
+            cmakeFlags = [ "-DBUILD_BENCHMARKS=ON" ];
+            buildInputs = old.buildInputs ++ [ pkgs.gbenchmark ];
+            postInstall = ''
+              install -D gesichtool_bench $out/bin/gesichtool_bench
+              install -D $src/bench/run_corpus.sh $out/bin/gesichtool-run-corpus
+            '';
+          });
         };
       }
     );
@@ -0,0 +1,124 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_BOUNDED_QUEUE_HPP
+#define HEADER_GESICHTOOL_BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace gesichtool {
+
+/** A multi-producer/multi-consumer queue with a fixed capacity,
+    push() blocks while the queue is full, pop() while it is empty. */
+template<typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) :
+    m_capacity(capacity),
+    m_mutex(),
+    m_not_empty(),
+    m_not_full(),
+    m_items(),
+    m_closed(false)
+  {}
+
+  /** Returns false if the queue was closed, the item is dropped then */
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_full.wait(lock, [this]{ return m_closed || m_items.size() < m_capacity; });
+    if (m_closed) {
+      return false;
+    }
+
+    m_items.push_back(std::move(item));
+    lock.unlock();
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  /** Returns std::nullopt once the queue is closed and drained */
+  std::optional<T> pop()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_empty.wait(lock, [this]{ return m_closed || !m_items.empty(); });
+    if (m_items.empty()) {
+      return std::nullopt;
+    }
+
+    T item = std::move(m_items.front());
+    m_items.pop_front();
+    lock.unlock();
+    m_not_full.notify_one();
+    return item;
+  }
+
+  /** Returns std::nullopt when the queue is empty, never blocks */
+  std::optional<T> try_pop()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_items.empty()) {
+      return std::nullopt;
+    }
+
+    T item = std::move(m_items.front());
+    m_items.pop_front();
+    lock.unlock();
+    m_not_full.notify_one();
+    return item;
+  }
+
+  /** Number of queued items, only a snapshot for statistics */
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_items.size();
+  }
+
+  /** Reject further pushes and wake up all waiting threads, items
+      already in the queue can still be popped */
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_not_empty.notify_all();
+    m_not_full.notify_all();
+  }
+
+private:
+  size_t const m_capacity;
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+  std::deque<T> m_items;
+  bool m_closed;
+
+public:
+  BoundedQueue(BoundedQueue const&) = delete;
+  BoundedQueue& operator=(BoundedQueue const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
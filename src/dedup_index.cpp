@@ -0,0 +1,192 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "dedup_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <opencv2/opencv.hpp>
+
+namespace gesichtool {
+
+namespace {
+
+// Whether 'fn' returns true for 'key' or a value that differs from it
+// in up to 'radius' of the bits from 'first_bit' to 'width', every
+// value is visited once
+template<typename Fn>
+bool any_within(uint64_t key, size_t first_bit, size_t width, int radius, Fn const& fn)
+{
+  if (fn(key)) {
+    return true;
+  }
+
+  if (radius == 0) {
+    return false;
+  }
+
+  for (size_t bit = first_bit; bit < width; ++bit) {
+    if (any_within(key ^ (uint64_t{1} << bit), bit + 1, width, radius - 1, fn)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+uint64_t dhash(cv::Mat const& crop)
+{
+  cv::Mat gray;
+  if (crop.channels() == 1) {
+    gray = crop;
+  } else {
+    cv::cvtColor(crop, gray, cv::COLOR_BGR2GRAY);
+  }
+
+  cv::Mat small;
+  cv::resize(gray, small, cv::Size(9, 8), 0.0, 0.0, cv::INTER_AREA);
+
+  uint64_t hash = 0;
+  for (int y = 0; y < 8; ++y) {
+    unsigned char const* const row = small.ptr<unsigned char>(y);
+    for (int x = 0; x < 8; ++x) {
+      hash = (hash << 1) | (row[x] > row[x + 1] ? 1 : 0);
+    }
+  }
+  return hash;
+}
+
+DedupIndex::DedupIndex(int max_distance, std::filesystem::path const& index_file) :
+  m_max_distance(max_distance),
+  m_probe_radius(max_distance / static_cast<int>(kBands)),
+  m_mutex(),
+  m_bands(),
+  m_file(nullptr)
+{
+  if (max_distance < 0 || max_distance > kMaxDistance) {
+    throw std::invalid_argument(fmt::format("dedup distance must be between 0 and {}", kMaxDistance));
+  }
+
+  for (auto& buckets : m_bands) {
+    buckets.resize(size_t{1} << kBandBits);
+  }
+
+  if (index_file.empty()) {
+    return;
+  }
+
+  {
+    std::ifstream in(index_file);
+    std::string line;
+    while (std::getline(in, line)) {
+      // a truncated last line from an interrupted run is ignored, as
+      // is anything else that isn't a hash
+      if (line.size() != 16 ||
+          !std::all_of(line.begin(), line.end(), [](unsigned char c) { return std::isxdigit(c); })) {
+        continue;
+      }
+
+      add(std::stoull(line, nullptr, 16));
+    }
+  }
+
+  m_file = fopen(index_file.c_str(), "a");
+  if (m_file == nullptr) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", index_file));
+  }
+}
+
+DedupIndex::~DedupIndex()
+{
+  if (m_file != nullptr) {
+    fclose(m_file);
+  }
+}
+
+bool
+DedupIndex::insert(uint64_t hash)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (contains(hash)) {
+    return false;
+  }
+
+  add(hash);
+  return true;
+}
+
+void
+DedupIndex::persist(std::span<uint64_t const> hashes)
+{
+  if (m_file == nullptr || hashes.empty()) {
+    return;
+  }
+
+  std::string lines;
+  for (uint64_t const hash : hashes) {
+    fmt::format_to(std::back_inserter(lines), "{:016x}\n", hash);
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (fwrite(lines.data(), lines.size(), 1, m_file) != 1 || fflush(m_file) != 0) {
+    throw std::system_error(errno, std::generic_category(), "failed to write dedup index");
+  }
+}
+
+bool
+DedupIndex::contains(uint64_t hash) const
+{
+  for (size_t band = 0; band < kBands; ++band)
+  {
+    auto const& buckets = m_bands[band];
+    uint64_t const key = (hash >> (band * kBandBits)) & ((uint64_t{1} << kBandBits) - 1);
+    bool const found = any_within(key, 0, kBandBits, m_probe_radius, [&](uint64_t probe) {
+      std::vector<uint64_t> const& bucket = buckets[probe];
+      return std::any_of(bucket.begin(), bucket.end(), [&](uint64_t other) {
+        return std::popcount(other ^ hash) <= m_max_distance;
+      });
+    });
+    if (found) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+DedupIndex::add(uint64_t hash)
+{
+  for (size_t band = 0; band < kBands; ++band) {
+    uint64_t const key = (hash >> (band * kBandBits)) & ((uint64_t{1} << kBandBits) - 1);
+    m_bands[band][key].push_back(hash);
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
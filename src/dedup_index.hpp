@@ -0,0 +1,99 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_DEDUP_INDEX_HPP
+#define HEADER_GESICHTOOL_DEDUP_INDEX_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+namespace gesichtool {
+
+/** Difference hash of a crop: every bit tells whether a pixel of a
+    9x8 grayscale reduction is brighter than its right neighbour.
+    Near-identical crops differ in few bits. */
+uint64_t dhash(cv::Mat const& crop);
+
+/** Remembers the hashes of the crops written so far and recognizes
+    crops within a Hamming distance of 'max_distance' of one of them.
+    This is multi-index hashing: the 64 bits are split into 4 bands of
+    16 bits, and two hashes that close differ in at most
+    max_distance / 4 bits of at least one band. A lookup probes only
+    the buckets within that radius in every band, so it never scans a
+    large part of the index, also at large distances.
+
+    With a file, the hashes of earlier runs are loaded from it and the
+    hashes of written crops appended as 16 hex digits per line, so
+    incremental runs skip faces that were already written. Thread
+    safe. */
+class DedupIndex
+{
+public:
+  /** Beyond this unrelated faces start to match and lookups probe
+      hundreds of buckets per band */
+  static constexpr int kMaxDistance = 11;
+
+public:
+  /** Throws std::invalid_argument unless 0 <= max_distance <= kMaxDistance */
+  DedupIndex(int max_distance, std::filesystem::path const& index_file);
+  ~DedupIndex();
+
+  /** Adds 'hash' and returns true unless it is a near-duplicate of a
+      known hash, checking and adding happen atomically. The hash is
+      only kept for this run until it is passed to persist(). */
+  bool insert(uint64_t hash);
+
+  /** Append the hashes of crops that were durably written to the file */
+  void persist(std::span<uint64_t const> hashes);
+
+private:
+  static constexpr size_t kBands = 4;
+  static constexpr size_t kBandBits = 64 / kBands;
+
+private:
+  bool contains(uint64_t hash) const;
+  void add(uint64_t hash);
+
+private:
+  int const m_max_distance;
+
+  // bits a hash within m_max_distance differs in at least one band
+  int const m_probe_radius;
+  std::mutex m_mutex;
+
+  // per band the hashes by the value of their bits in that band, the
+  // buckets hold the hashes themselves, so a probe is one lookup
+  std::array<std::vector<std::vector<uint64_t>>, kBands> m_bands;
+  FILE* m_file;
+
+public:
+  DedupIndex(DedupIndex const&) = delete;
+  DedupIndex& operator=(DedupIndex const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,189 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "detections_writer.hpp"
+
+#include <cerrno>
+#include <iterator>
+#include <system_error>
+#include <utility>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+
+namespace gesichtool {
+
+DetectionsWriter::DetectionsWriter(std::filesystem::path const& path, bool append) :
+  m_mutex(),
+  m_file(fopen(path.c_str(), append ? "a" : "w"))
+{
+  if (m_file == nullptr) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", path));
+  }
+}
+
+DetectionsWriter::~DetectionsWriter()
+{
+  if (m_file != nullptr) {
+    fclose(m_file);
+  }
+}
+
+void
+DetectionsWriter::write(std::filesystem::path const& image_path, cv::Size const& image_size,
+                        std::vector<Face> const& faces, std::optional<size_t> frame)
+{
+  // format outside of the lock, only the write is serialized
+  std::string line = fmt::format(R"({{"path": {}, )", json_string(image_path.native()));
+  if (frame) {
+    fmt::format_to(std::back_inserter(line), R"("frame": {}, )", *frame);
+  }
+  fmt::format_to(std::back_inserter(line), R"("width": {}, "height": {}, "faces": [)",
+                 image_size.width, image_size.height);
+  for (size_t idx = 0; idx < faces.size(); ++idx)
+  {
+    if (idx != 0) {
+      line += ", ";
+    }
+    line += json_face(faces[idx]);
+  }
+  line += "]}\n";
+
+  write_line(line);
+}
+
+void
+DetectionsWriter::write_line(std::string const& line)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (fwrite(line.data(), line.size(), 1, m_file) != 1 || fflush(m_file) != 0) {
+    throw std::system_error(errno, std::generic_category(), "failed to write detections");
+  }
+}
+
+void
+DetectionsWriter::write_shard_complete(size_t shard, size_t shard_count, size_t images)
+{
+  write_line(fmt::format(R"({{"shard": {}, "shard_count": {}, "complete": true, "images": {}}}\n)",
+                         shard, shard_count, images));
+}
+
+void
+DetectionsWriter::close()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (m_file == nullptr) {
+    return;
+  }
+
+  FILE* const file = std::exchange(m_file, nullptr);
+  if (fclose(file) != 0) {
+    throw std::system_error(errno, std::generic_category(), "failed to write detections");
+  }
+}
+
+namespace {
+
+// Returns the length of the well-formed UTF-8 sequence at the start
+// of 'text' or 0, rejecting overlong forms, surrogates and code points
+// past U+10FFFF
+size_t utf8_sequence_length(std::string_view text)
+{
+  auto const byte = [&text](size_t idx) { return static_cast<unsigned char>(text[idx]); };
+  auto const continuation = [&](size_t idx) { return idx < text.size() && (byte(idx) & 0xc0) == 0x80; };
+
+  unsigned char const lead = byte(0);
+  if (lead < 0x80) {
+    return 1;
+  } else if (lead >= 0xc2 && lead <= 0xdf) {
+    return continuation(1) ? 2 : 0;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    if (!continuation(1) || !continuation(2) ||
+        (lead == 0xe0 && byte(1) < 0xa0) ||
+        (lead == 0xed && byte(1) >= 0xa0)) {
+      return 0;
+    }
+    return 3;
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    if (!continuation(1) || !continuation(2) || !continuation(3) ||
+        (lead == 0xf0 && byte(1) < 0x90) ||
+        (lead == 0xf4 && byte(1) >= 0x90)) {
+      return 0;
+    }
+    return 4;
+  } else {
+    return 0;
+  }
+}
+
+} // namespace
+
+std::string json_string(std::string_view text)
+{
+  std::string result = "\"";
+  size_t pos = 0;
+  while (pos < text.size())
+  {
+    char const c = text[pos];
+    switch (c)
+    {
+      case '"': result += "\\\""; break;
+      case '\\': result += "\\\\"; break;
+      case '\b': result += "\\b"; break;
+      case '\f': result += "\\f"; break;
+      case '\n': result += "\\n"; break;
+      case '\r': result += "\\r"; break;
+      case '\t': result += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          fmt::format_to(std::back_inserter(result), "\\u{:04x}", static_cast<unsigned int>(c));
+        } else if (size_t const length = utf8_sequence_length(text.substr(pos)); length != 0) {
+          result.append(text.substr(pos, length));
+          pos += length;
+          continue;
+        } else {
+          // paths are arbitrary bytes, JSON has to be valid UTF-8
+          result += "\\ufffd";
+        }
+        break;
+    }
+    pos += 1;
+  }
+  result += '"';
+  return result;
+}
+
+std::string json_face(Face const& face)
+{
+  std::string result = fmt::format(R"({{"x": {}, "y": {}, "width": {}, "height": {}, "score": {})",
+                                   face.rect.x, face.rect.y, face.rect.width, face.rect.height,
+                                   face.score);
+  if (!face.landmarks.empty()) {
+    result += R"(, "landmarks": [)";
+    for (size_t idx = 0; idx < face.landmarks.size(); ++idx) {
+      fmt::format_to(std::back_inserter(result), "{}[{:.1f}, {:.1f}]", idx == 0 ? "" : ", ",
+                     face.landmarks[idx].x, face.landmarks[idx].y);
+    }
+    result += ']';
+  }
+  result += '}';
+  return result;
+}
+
+} // namespace gesichtool
+
+/* EOF */
@@ -0,0 +1,87 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_DETECTIONS_WRITER_HPP
+#define HEADER_GESICHTOOL_DETECTIONS_WRITER_HPP
+
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "face.hpp"
+
+namespace gesichtool {
+
+/** Writes one JSON object per image to a JSON Lines file:
+
+    {"path": "img.jpg", "width": 640, "height": 480,
+     "faces": [{"x": 10, "y": 20, "width": 100, "height": 100, "score": 0.8}]}
+
+    Coordinates are in full resolution pixels, video frames have an
+    additional "frame" field and faces with --align a "landmarks" list
+    of [x, y] points. A run over one shard of the inputs ends
+    with a completion record:
+
+    {"shard": 3, "shard_count": 16, "complete": true, "images": 1234}
+
+    Every record is flushed as soon as it is written, so it is never
+    behind the ResultCache entry of its image. With 'append' the
+    records of earlier runs are kept, for runs resumed with a cache.
+    Thread safe. */
+class DetectionsWriter
+{
+public:
+  DetectionsWriter(std::filesystem::path const& path, bool append);
+  ~DetectionsWriter();
+
+  /** 'frame' is the frame number for video input */
+  void write(std::filesystem::path const& image_path, cv::Size const& image_size,
+             std::vector<Face> const& faces, std::optional<size_t> frame = std::nullopt);
+
+  /** Record that all 'images' of the shard were processed */
+  void write_shard_complete(size_t shard, size_t shard_count, size_t images);
+
+  /** Flush and close the file, throws on error */
+  void close();
+
+private:
+  void write_line(std::string const& line);
+
+private:
+  std::mutex m_mutex;
+  FILE* m_file;
+
+public:
+  DetectionsWriter(DetectionsWriter const&) = delete;
+  DetectionsWriter& operator=(DetectionsWriter const&) = delete;
+};
+
+/** Quote 'text' as JSON string, bytes that aren't valid UTF-8 are
+    replaced by U+FFFD */
+std::string json_string(std::string_view text);
+
+/** Format 'face' as JSON object */
+std::string json_face(Face const& face);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
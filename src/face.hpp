@@ -14,31 +14,29 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-#ifndef HEADER_GESICHTOOL_SEMAPHORE_GUARD_HPP
-#define HEADER_GESICHTOOL_SEMAPHORE_GUARD_HPP
+#ifndef HEADER_GESICHTOOL_FACE_HPP
+#define HEADER_GESICHTOOL_FACE_HPP
 
-#include <semaphore>
+#include <vector>
 
-template<typename Sem>
-class SemaphoreGuard
+#include <opencv2/core/types.hpp>
+
+namespace gesichtool {
+
+struct Face
 {
-public:
-  explicit SemaphoreGuard(Sem& sem) :
-    m_sem(sem)
-  {
-    m_sem.acquire();
-  }
-
-  ~SemaphoreGuard() {
-    m_sem.release();
-  }
-
-private:
-  Sem& m_sem;
-
-public:
-  SemaphoreGuard(SemaphoreGuard const&) = delete;
-  SemaphoreGuard& operator=(SemaphoreGuard const&) = delete;
+  cv::Rect rect;
+
+  // detector specific confidence, dlib's detection score or the
+  // cascade's level weight for OpenCV
+  double score;
+
+  // facial landmarks from --align, in the same coordinates as 'rect'
+  std::vector<cv::Point2f> landmarks = {};
 };
 
+} // namespace gesichtool
+
 #endif
+
+/* EOF */
@@ -0,0 +1,73 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "face_aligner.hpp"
+
+#include <stdexcept>
+
+#include <dlib/opencv.h>
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <opencv2/opencv.hpp>
+
+namespace gesichtool {
+
+FaceAligner::FaceAligner(std::filesystem::path const& model) :
+  m_predictor()
+{
+  dlib::deserialize(model.string()) >> m_predictor;
+
+  // get_face_chip_details() only knows these two layouts
+  if (m_predictor.num_parts() != 5 && m_predictor.num_parts() != 68) {
+    throw std::runtime_error(fmt::format("{}: expected a 5 or 68 landmark model, got {} landmarks",
+                                         model, m_predictor.num_parts()));
+  }
+}
+
+void
+FaceAligner::add_landmarks(cv::Mat const& image, std::vector<Face>& faces) const
+{
+  if (faces.empty()) {
+    return;
+  }
+
+  cv::Mat gray;
+  if (image.channels() == 1) {
+    gray = image;
+  } else {
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+  }
+  dlib::cv_image<unsigned char> const dlib_image(gray);
+
+  for (Face& face : faces)
+  {
+    dlib::full_object_detection const shape = m_predictor(
+      dlib_image, dlib::rectangle(face.rect.x, face.rect.y,
+                                  face.rect.x + face.rect.width - 1,
+                                  face.rect.y + face.rect.height - 1));
+
+    face.landmarks.clear();
+    for (unsigned long idx = 0; idx < shape.num_parts(); ++idx) {
+      face.landmarks.emplace_back(static_cast<float>(shape.part(idx).x()),
+                                  static_cast<float>(shape.part(idx).y()));
+    }
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
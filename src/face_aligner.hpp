@@ -0,0 +1,57 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_FACE_ALIGNER_HPP
+#define HEADER_GESICHTOOL_FACE_ALIGNER_HPP
+
+#include <filesystem>
+#include <vector>
+
+#include <dlib/image_processing.h>
+#include <opencv2/core/mat.hpp>
+
+#include "face.hpp"
+
+namespace gesichtool {
+
+/** Finds facial landmarks with a dlib shape predictor, such as
+    shape_predictor_5_face_landmarks.dat, for align_face(). The model
+    is loaded once and shared, predicting is thread safe. */
+class FaceAligner
+{
+public:
+  /** Throws when the model can't be loaded or doesn't have 5 or 68
+      landmarks */
+  explicit FaceAligner(std::filesystem::path const& model);
+
+  /** Sets Face::landmarks of 'faces' found in 'image', which is
+      grayscale or BGR */
+  void add_landmarks(cv::Mat const& image, std::vector<Face>& faces) const;
+
+private:
+  dlib::shape_predictor m_predictor;
+
+public:
+  FaceAligner(FaceAligner const&) = delete;
+  FaceAligner& operator=(FaceAligner const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,59 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_FACE_DETECTOR_HPP
+#define HEADER_GESICHTOOL_FACE_DETECTOR_HPP
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "face.hpp"
+
+namespace gesichtool {
+
+/** Detectors are not thread safe, each thread creates its own through
+    a FaceDetectorFactory */
+class FaceDetector
+{
+public:
+  virtual ~FaceDetector() = default;
+  virtual std::vector<Face> detect(cv::Mat const& image) = 0;
+
+  /** Detectors that run faster on several images at once process up
+      to batch_size() images per detect_batch() call */
+  virtual size_t batch_size() const { return 1; }
+
+  virtual std::vector<std::vector<Face>> detect_batch(std::vector<cv::Mat> const& images)
+  {
+    std::vector<std::vector<Face>> results;
+    results.reserve(images.size());
+    for (cv::Mat const& image : images) {
+      results.push_back(detect(image));
+    }
+    return results;
+  }
+};
+
+using FaceDetectorFactory = std::function<std::unique_ptr<FaceDetector>()>;
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
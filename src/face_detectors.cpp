@@ -0,0 +1,624 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "face_detectors.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <dlib/dnn.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/opencv.h>
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <opencv2/opencv.hpp>
+
+namespace gesichtool {
+
+namespace {
+
+// dlib's frontal face detector slides an 80x80 window over an image
+// pyramid that shrinks by 5/6 per level, the CNN finds faces down to
+// about 40x40
+constexpr double kDlibWindowSize = 80.0;
+constexpr double kDlibCnnWindowSize = 40.0;
+constexpr double kDlibPyramidStep = 6.0 / 5.0;
+
+// Returns the factor by which the detection image is resized before
+// running dlib on it. Faces below --min-size are not wanted, so the
+// image shrinks until the smallest wanted face just fills the window,
+// which skips all the pyramid levels that could only find smaller
+// faces. Growing the image is expensive and is capped by --upsample.
+double dlib_image_scale(Options const& opts, double window_size)
+{
+  double const max_scale = std::pow(2.0, opts.upsample);
+  if (!opts.min_size) {
+    return max_scale;
+  }
+
+  double const min_face = static_cast<double>(std::min(opts.min_size->width, opts.min_size->height)) / opts.detect_scale;
+  return std::min(max_scale, window_size / std::max(1.0, min_face));
+}
+
+// Returns the frontal face detector with its pyramid cut off at the
+// level that finds faces of --max-size in an image resized by 'scale'
+dlib::frontal_face_detector make_dlib_detector(Options const& opts, double scale)
+{
+  dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+  if (!opts.max_size) {
+    return detector;
+  }
+
+  double const max_face = static_cast<double>(std::max(opts.max_size->width, opts.max_size->height)) / opts.detect_scale * scale;
+  unsigned long const levels = 1 + static_cast<unsigned long>(
+    std::ceil(std::log(std::max(1.0, max_face / kDlibWindowSize)) / std::log(kDlibPyramidStep)));
+
+  // the scanner is only handed out as a copy, so the detector gets
+  // rebuilt from its parts
+  auto scanner = detector.get_scanner();
+  scanner.set_max_pyramid_levels(levels);
+
+  std::vector<dlib::frontal_face_detector::feature_vector_type> weights;
+  for (unsigned long idx = 0; idx < detector.num_detectors(); ++idx) {
+    weights.push_back(detector.get_w(idx));
+  }
+
+  return dlib::frontal_face_detector(scanner, detector.get_overlap_tester(), weights);
+}
+
+class DlibFaceDetector : public FaceDetector
+{
+public:
+  DlibFaceDetector(Options const& opts) :
+    m_opts(opts),
+    m_scale(dlib_image_scale(opts, kDlibWindowSize)),
+    m_detector(make_dlib_detector(opts, m_scale)),
+    m_scaled()
+  {}
+
+  std::vector<Face> detect(cv::Mat const& image) override
+  {
+    cv::Mat gray = image;
+    if (image.channels() != 1) {
+      cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    }
+
+    if (m_scale != 1.0) {
+      cv::resize(gray, m_scaled, cv::Size(), m_scale, m_scale,
+                 m_scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+      gray = m_scaled;
+    }
+
+    dlib::cv_image<unsigned char> const dlibImage(gray);
+
+    std::vector<dlib::rect_detection> dlib_faces;
+    m_detector(dlibImage, dlib_faces, m_opts.threshold);
+
+    std::vector<Face> faces;
+    for (auto const& detection : dlib_faces)
+    {
+      dlib::rectangle const& rect = detection.rect;
+      faces.push_back(Face{cv::Rect(static_cast<int>(rect.left() / m_scale),
+                                    static_cast<int>(rect.top() / m_scale),
+                                    static_cast<int>(rect.width() / m_scale),
+                                    static_cast<int>(rect.height() / m_scale)),
+                           detection.detection_confidence});
+    }
+    return faces;
+  }
+
+private:
+  Options const& m_opts;
+  double m_scale;
+
+  // not thread safe, so each thread needs its own
+  dlib::frontal_face_detector m_detector;
+
+  // scratch buffer for the resized image
+  cv::Mat m_scaled;
+};
+
+class OpenCVFaceDetector : public FaceDetector
+{
+public:
+  OpenCVFaceDetector(Options const& opts, cv::FileNode const& cascade_node) :
+    OpenCVFaceDetector(opts, cascade_node, opts.detect_scale, opts.min_neighbors)
+  {}
+
+  /** 'image_scale' is the factor by which the images given to detect()
+      are reduced from full resolution */
+  OpenCVFaceDetector(Options const& opts, cv::FileNode const& cascade_node,
+                     int image_scale, int min_neighbors) :
+    m_opts(opts),
+    m_image_scale(image_scale),
+    m_min_neighbors(min_neighbors),
+    m_face_cascade()
+  {
+    if (!m_face_cascade.read(cascade_node)) {
+      throw std::runtime_error("failed to read face cascade");
+    }
+  }
+
+  std::vector<Face> detect(cv::Mat const& image) override
+  {
+    // min/max sizes are given for the full resolution image
+    auto const scaled = [this](std::optional<cv::Size> const& size) {
+      return size ? cv::Size(size->width / m_image_scale,
+                             size->height / m_image_scale) : cv::Size();
+    };
+
+    std::vector<cv::Rect> rects;
+    std::vector<int> reject_levels;
+    std::vector<double> level_weights;
+    m_face_cascade.detectMultiScale(image, rects, reject_levels, level_weights,
+                                    m_opts.scale_factor, m_min_neighbors, 0,
+                                    scaled(m_opts.min_size),
+                                    scaled(m_opts.max_size),
+                                    true);
+
+    std::vector<Face> faces;
+    for (size_t idx = 0; idx < rects.size(); ++idx)
+    {
+      faces.push_back(Face{rects[idx], idx < level_weights.size() ? level_weights[idx] : 0.0});
+    }
+    return faces;
+  }
+
+private:
+  Options const& m_opts;
+  int m_image_scale;
+  int m_min_neighbors;
+
+  // CascadeClassifier is neither thread safe nor can it be copied
+  cv::CascadeClassifier m_face_cascade;
+};
+
+// The Haar cascade parsed only once, detectors for the worker threads
+// are built from the already parsed FileStorage
+class HaarCascade
+{
+public:
+  HaarCascade(Options const& opts) :
+    m_opts(opts),
+    m_cascade_file(cv::samples::findFile("haarcascades/haarcascade_frontalface_default.xml")),
+    m_storage(m_cascade_file, cv::FileStorage::READ),
+    m_mutex()
+  {
+    if (!m_storage.isOpened()) {
+      throw std::runtime_error(fmt::format("failed to load {}", m_cascade_file));
+    }
+
+    // fail early when the cascade is broken
+    OpenCVFaceDetector const check_detector(opts, m_storage.getFirstTopLevelNode());
+  }
+
+  template<typename... Args>
+  std::unique_ptr<OpenCVFaceDetector> make_detector(Args&&... args)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return std::make_unique<OpenCVFaceDetector>(m_opts, m_storage.getFirstTopLevelNode(),
+                                                std::forward<Args>(args)...);
+  }
+
+private:
+  Options const& m_opts;
+  std::string m_cascade_file;
+  cv::FileStorage m_storage;
+
+  // reading nodes from a FileStorage isn't thread safe
+  std::mutex m_mutex;
+
+public:
+  HaarCascade(HaarCascade const&) = delete;
+  HaarCascade& operator=(HaarCascade const&) = delete;
+};
+
+// Runs the Haar cascade on a further reduced image and gives only the
+// padded regions around its candidates to the expensive verifier.
+// The cascade is run with a single neighbor, as a missed candidate
+// can't be recovered while false candidates only cost verifier time.
+class PrefilterFaceDetector : public FaceDetector
+{
+public:
+  PrefilterFaceDetector(Options const& opts, HaarCascade& cascade,
+                        std::unique_ptr<FaceDetector> verifier) :
+    m_opts(opts),
+    m_prefilter(cascade.make_detector(opts.detect_scale * opts.prefilter_scale, 1)),
+    m_verifier(std::move(verifier)),
+    m_gray(),
+    m_small()
+  {}
+
+  std::vector<Face> detect(cv::Mat const& image) override
+  {
+    return detect_batch({image}).front();
+  }
+
+  size_t batch_size() const override { return m_verifier->batch_size(); }
+
+  std::vector<std::vector<Face>> detect_batch(std::vector<cv::Mat> const& images) override
+  {
+    // the regions of all images go to the verifier in one batch
+    std::vector<cv::Mat> regions;
+    std::vector<std::pair<size_t, cv::Point>> region_origins;
+    for (size_t image_idx = 0; image_idx < images.size(); ++image_idx)
+    {
+      for (cv::Rect const& region : candidate_regions(images[image_idx]))
+      {
+        regions.push_back(images[image_idx](region));
+        region_origins.emplace_back(image_idx, region.tl());
+      }
+    }
+
+    std::vector<std::vector<Face>> const region_faces =
+      regions.empty() ? std::vector<std::vector<Face>>() : m_verifier->detect_batch(regions);
+
+    std::vector<std::vector<Face>> results(images.size());
+    for (size_t region_idx = 0; region_idx < region_faces.size(); ++region_idx)
+    {
+      auto const& [image_idx, origin] = region_origins[region_idx];
+      for (Face const& face : region_faces[region_idx])
+      {
+        results[image_idx].push_back(Face{face.rect + origin, face.score});
+      }
+    }
+    return results;
+  }
+
+private:
+  // Returns the candidate rectangles padded by half their size on each
+  // side and merged where they overlap, so no face is verified twice
+  std::vector<cv::Rect> candidate_regions(cv::Mat const& image)
+  {
+    cv::Mat gray = image;
+    if (image.channels() != 1) {
+      cv::cvtColor(image, m_gray, cv::COLOR_BGR2GRAY);
+      gray = m_gray;
+    }
+
+    int const scale = m_opts.prefilter_scale;
+    cv::Mat small = gray;
+    if (scale != 1) {
+      cv::resize(gray, m_small, cv::Size(), 1.0 / scale, 1.0 / scale, cv::INTER_AREA);
+      small = m_small;
+    }
+
+    cv::Rect const bounds(0, 0, image.cols, image.rows);
+    std::vector<cv::Rect> regions;
+    for (Face const& candidate : m_prefilter->detect(small))
+    {
+      cv::Rect const& rect = candidate.rect;
+      regions.push_back(bounds & cv::Rect((rect.x - rect.width / 2) * scale,
+                                          (rect.y - rect.height / 2) * scale,
+                                          rect.width * 2 * scale,
+                                          rect.height * 2 * scale));
+    }
+
+    for (bool merged = true; merged;)
+    {
+      merged = false;
+      for (size_t lhs = 0; lhs < regions.size() && !merged; ++lhs) {
+        for (size_t rhs = lhs + 1; rhs < regions.size() && !merged; ++rhs) {
+          if (!(regions[lhs] & regions[rhs]).empty()) {
+            regions[lhs] |= regions[rhs];
+            regions.erase(regions.begin() + static_cast<std::ptrdiff_t>(rhs));
+            merged = true;
+          }
+        }
+      }
+    }
+
+    return regions;
+  }
+
+private:
+  Options const& m_opts;
+  std::unique_ptr<OpenCVFaceDetector> m_prefilter;
+  std::unique_ptr<FaceDetector> m_verifier;
+
+  // scratch buffers, reused for every image
+  cv::Mat m_gray;
+  cv::Mat m_small;
+};
+
+// The network from dlib's dnn_mmod_face_detection_ex.cpp that
+// mmod_human_face_detector.dat was trained for
+template<long num_filters, typename SUBNET> using con5d = dlib::con<num_filters, 5, 5, 2, 2, SUBNET>;
+template<long num_filters, typename SUBNET> using con5 = dlib::con<num_filters, 5, 5, 1, 1, SUBNET>;
+template<typename SUBNET> using downsampler = dlib::relu<dlib::affine<con5d<32, dlib::relu<dlib::affine<con5d<32, dlib::relu<dlib::affine<con5d<16, SUBNET>>>>>>>>>;
+template<typename SUBNET> using rcon5 = dlib::relu<dlib::affine<con5<45, SUBNET>>>;
+using DlibCnnNet = dlib::loss_mmod<dlib::con<1, 9, 9, 1, 1, rcon5<rcon5<rcon5<downsampler<dlib::input_rgb_image_pyramid<dlib::pyramid_down<6>>>>>>>>;
+
+// Runs dlib's CNN face detector. All images in a dlib batch must have
+// the same size, so images are sorted by size and grouped while the
+// padding to the largest one in the group stays small.
+class DlibCnnFaceDetector : public FaceDetector
+{
+public:
+  DlibCnnFaceDetector(Options const& opts, DlibCnnNet const& net) :
+    m_opts(opts),
+    m_scale(dlib_image_scale(opts, kDlibCnnWindowSize)),
+    m_net(net),
+    m_scaled(),
+    m_padded(),
+    m_inputs()
+  {}
+
+  std::vector<Face> detect(cv::Mat const& image) override
+  {
+    return detect_batch({image}).front();
+  }
+
+  size_t batch_size() const override { return m_opts.batch_size; }
+
+  std::vector<std::vector<Face>> detect_batch(std::vector<cv::Mat> const& images) override
+  {
+    std::vector<size_t> order(images.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&images](size_t lhs, size_t rhs) {
+      return images[lhs].size().area() < images[rhs].size().area();
+    });
+
+    std::vector<std::vector<Face>> results(images.size());
+    size_t group_begin = 0;
+    while (group_begin < order.size())
+    {
+      // grow the group while the padded area stays within 4/3 of the
+      // actual pixels
+      cv::Size padded_size = images[order[group_begin]].size();
+      int64_t pixels = padded_size.area();
+      size_t group_end = group_begin + 1;
+      for (; group_end < order.size(); ++group_end)
+      {
+        cv::Size const size = images[order[group_end]].size();
+        cv::Size const grown(std::max(padded_size.width, size.width),
+                             std::max(padded_size.height, size.height));
+        int64_t const grown_pixels = pixels + size.area();
+        if (static_cast<int64_t>(grown.area()) * static_cast<int64_t>(group_end - group_begin + 1) * 3 > grown_pixels * 4) {
+          break;
+        }
+        padded_size = grown;
+        pixels = grown_pixels;
+      }
+
+      detect_group(images, std::span(order).subspan(group_begin, group_end - group_begin),
+                   padded_size, results);
+      group_begin = group_end;
+    }
+    return results;
+  }
+
+private:
+  void detect_group(std::vector<cv::Mat> const& images, std::span<size_t const> group,
+                    cv::Size const& padded_size, std::vector<std::vector<Face>>& results)
+  {
+    // rounding is monotonic, so no scaled image exceeds 'input_size'
+    auto const scaled_size = [this](cv::Size const& size) {
+      return cv::Size(std::max(1, static_cast<int>(std::lround(size.width * m_scale))),
+                      std::max(1, static_cast<int>(std::lround(size.height * m_scale))));
+    };
+    cv::Size const input_size = scaled_size(padded_size);
+
+    m_inputs.resize(group.size());
+    for (size_t idx = 0; idx < group.size(); ++idx)
+    {
+      cv::Mat const& image = images[group[idx]];
+      cv::Mat scaled = image;
+      if (m_scale != 1.0) {
+        cv::resize(image, m_scaled, scaled_size(image.size()), 0.0, 0.0,
+                   m_scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+        scaled = m_scaled;
+      }
+
+      // pad at the right and bottom, so coordinates stay the same
+      cv::copyMakeBorder(scaled, m_padded,
+                         0, input_size.height - scaled.rows,
+                         0, input_size.width - scaled.cols,
+                         cv::BORDER_CONSTANT, cv::Scalar::all(0));
+      dlib::assign_image(m_inputs[idx], dlib::cv_image<dlib::bgr_pixel>(m_padded));
+    }
+
+    std::vector<std::vector<dlib::mmod_rect>> const detections =
+      m_net.process_batch(m_inputs, m_inputs.size(), m_opts.threshold);
+
+    for (size_t idx = 0; idx < group.size(); ++idx)
+    {
+      cv::Rect const bounds(0, 0, images[group[idx]].cols, images[group[idx]].rows);
+      for (dlib::mmod_rect const& detection : detections[idx])
+      {
+        dlib::rectangle const& rect = detection.rect;
+        cv::Rect const face = bounds & cv::Rect(static_cast<int>(rect.left() / m_scale),
+                                                static_cast<int>(rect.top() / m_scale),
+                                                static_cast<int>(rect.width() / m_scale),
+                                                static_cast<int>(rect.height() / m_scale));
+        if (!face.empty()) {
+          results[group[idx]].push_back(Face{face, detection.detection_confidence});
+        }
+      }
+    }
+  }
+
+private:
+  Options const& m_opts;
+  double m_scale;
+
+  // not thread safe, so each thread has its own copy
+  DlibCnnNet m_net;
+
+  // scratch buffers, reused for every batch
+  cv::Mat m_scaled;
+  cv::Mat m_padded;
+  std::vector<dlib::matrix<dlib::rgb_pixel>> m_inputs;
+};
+
+// Runs an SSD face detection network, such as OpenCV's
+// res10_300x300_ssd, through cv::dnn. Images are resized to the
+// network input and stacked into one blob, so a GPU target processes
+// a whole batch per forward pass.
+class DnnFaceDetector : public FaceDetector
+{
+public:
+  DnnFaceDetector(Options const& opts) :
+    m_opts(opts),
+    m_net(cv::dnn::readNet(opts.dnn_model.string(), opts.dnn_config.string())),
+    m_blob()
+  {
+    if (m_net.empty()) {
+      throw std::runtime_error(fmt::format("failed to load {}", opts.dnn_model));
+    }
+
+    m_net.setPreferableBackend(opts.dnn_backend);
+    m_net.setPreferableTarget(opts.dnn_target);
+  }
+
+  std::vector<Face> detect(cv::Mat const& image) override
+  {
+    return detect_batch({image}).front();
+  }
+
+  size_t batch_size() const override { return m_opts.batch_size; }
+
+  std::vector<std::vector<Face>> detect_batch(std::vector<cv::Mat> const& images) override
+  {
+    // mean values the res10 SSD was trained with
+    m_blob = cv::dnn::blobFromImages(images, 1.0, m_opts.dnn_input_size,
+                                     cv::Scalar(104.0, 177.0, 123.0), false, false);
+    m_net.setInput(m_blob);
+    cv::Mat const output = m_net.forward();
+
+    // the output is 1x1xNx7 with rows of [image, label, confidence,
+    // left, top, right, bottom] in coordinates relative to the image
+    cv::Mat const detections(output.size[2], output.size[3], CV_32F,
+                             const_cast<float*>(output.ptr<float>()));
+
+    std::vector<std::vector<Face>> results(images.size());
+    for (int row = 0; row < detections.rows; ++row)
+    {
+      float const* const detection = detections.ptr<float>(row);
+      auto const image_idx = static_cast<size_t>(detection[0]);
+      double const confidence = detection[2];
+      if (image_idx >= images.size() || confidence < m_opts.confidence) {
+        continue;
+      }
+
+      cv::Size const size = images[image_idx].size();
+      cv::Rect const rect(cv::Point(static_cast<int>(detection[3] * static_cast<float>(size.width)),
+                                    static_cast<int>(detection[4] * static_cast<float>(size.height))),
+                          cv::Point(static_cast<int>(detection[5] * static_cast<float>(size.width)),
+                                    static_cast<int>(detection[6] * static_cast<float>(size.height))));
+      if (accept_size(rect.size())) {
+        results[image_idx].push_back(Face{rect, confidence});
+      }
+    }
+    return results;
+  }
+
+private:
+  // min/max sizes are given for the full resolution image
+  bool accept_size(cv::Size const& size) const
+  {
+    int const scale = m_opts.detect_scale;
+    if (m_opts.min_size &&
+        (size.width * scale < m_opts.min_size->width || size.height * scale < m_opts.min_size->height)) {
+      return false;
+    }
+
+    if (m_opts.max_size &&
+        (size.width * scale > m_opts.max_size->width || size.height * scale > m_opts.max_size->height)) {
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  Options const& m_opts;
+
+  // not thread safe, so each thread needs its own
+  cv::dnn::Net m_net;
+  cv::Mat m_blob;
+};
+
+} // namespace
+
+FaceDetectorFactory make_face_detector_factory(Options const& opts)
+{
+  FaceDetectorFactory make_detector;
+  switch (opts.mode)
+  {
+    case Mode::OPENCV: {
+      auto const cascade = std::make_shared<HaarCascade>(opts);
+      // the cascade itself needs no prefilter
+      return [cascade]{
+        return cascade->make_detector();
+      };
+    }
+
+    case Mode::DLIB:
+      make_detector = [&opts]{
+        return std::make_unique<DlibFaceDetector>(opts);
+      };
+      break;
+
+    case Mode::DNN: {
+      // fail early when the network can't be loaded
+      DnnFaceDetector const check_detector(opts);
+
+      make_detector = [&opts]{
+        return std::make_unique<DnnFaceDetector>(opts);
+      };
+      break;
+    }
+
+    case Mode::DLIB_CNN: {
+      // deserialized only once, the detectors copy the loaded network
+      auto const net = std::make_shared<DlibCnnNet>();
+      dlib::deserialize(opts.dlib_cnn_model.string()) >> *net;
+
+      make_detector = [&opts, net]{
+        return std::make_unique<DlibCnnFaceDetector>(opts, *net);
+      };
+      break;
+    }
+  }
+
+  // with --prefilter the mode's detector only verifies the candidates
+  // of a Haar cascade
+  if (opts.prefilter) {
+    auto const cascade = std::make_shared<HaarCascade>(opts);
+    return [&opts, cascade, make_verifier = std::move(make_detector)]{
+      return std::make_unique<PrefilterFaceDetector>(opts, *cascade, make_verifier());
+    };
+  }
+
+  return make_detector;
+}
+
+bool detects_in_color(Options const& opts)
+{
+  return opts.mode == Mode::DNN || opts.mode == Mode::DLIB_CNN;
+}
+
+} // namespace gesichtool
+
+/* EOF */
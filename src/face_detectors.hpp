@@ -0,0 +1,40 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_FACE_DETECTORS_HPP
+#define HEADER_GESICHTOOL_FACE_DETECTORS_HPP
+
+#include "face_detector.hpp"
+#include "options.hpp"
+
+namespace gesichtool {
+
+/** Returns a factory for detectors of Options::mode, wrapped into the
+    Haar prefilter with Options::prefilter. Cascades and networks are
+    loaded once here and shared by all created detectors, so a broken
+    model file throws right away. The detectors keep a reference to
+    'opts'. */
+FaceDetectorFactory make_face_detector_factory(Options const& opts);
+
+/** Whether the detectors run on color instead of grayscale images */
+bool detects_in_color(Options const& opts);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,151 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "face_extractor.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+#include <opencv2/opencv.hpp>
+
+#include "face_detectors.hpp"
+#include "image_codec.hpp"
+#include "image_header.hpp"
+#include "imaging.hpp"
+
+namespace gesichtool {
+
+FaceExtractor::FaceExtractor(Options const& opts) :
+  FaceExtractor(opts, make_face_detector_factory(opts))
+{
+}
+
+FaceExtractor::FaceExtractor(Options const& opts, FaceDetectorFactory const& make_detector) :
+  m_opts(opts),
+  m_detector(make_detector()),
+  m_aligner(),
+  m_codec(opts),
+  m_image()
+{
+  if (!opts.align_model.empty()) {
+    if (opts.output_size.width != opts.output_size.height) {
+      throw std::runtime_error("aligned faces need a square output size");
+    }
+    m_aligner.emplace(opts.align_model);
+  }
+}
+
+std::vector<ExtractedFace>
+FaceExtractor::process(std::span<unsigned char const> data)
+{
+  cv::Mat const detect_image = decode(data);
+  return extract(data, detect_image, detect(detect_image));
+}
+
+cv::Mat
+FaceExtractor::decode(std::span<unsigned char const> data)
+{
+  cv::Mat image;
+  if (!m_codec.decode(data, detect_decode_flag(m_opts), image)) {
+    throw std::runtime_error("failed to decode image");
+  }
+  return image;
+}
+
+std::vector<Face>
+FaceExtractor::detect(cv::Mat const& image)
+{
+  std::vector<Face> faces = m_detector->detect(image);
+  if (m_aligner) {
+    m_aligner->add_landmarks(image, faces);
+  }
+  return faces;
+}
+
+std::vector<std::vector<Face>>
+FaceExtractor::detect_batch(std::vector<cv::Mat> const& images)
+{
+  std::vector<std::vector<Face>> results = m_detector->detect_batch(images);
+  if (m_aligner) {
+    for (size_t idx = 0; idx < images.size(); ++idx) {
+      m_aligner->add_landmarks(images[idx], results[idx]);
+    }
+  }
+  return results;
+}
+
+size_t
+FaceExtractor::batch_size() const
+{
+  return m_detector->batch_size();
+}
+
+std::vector<ExtractedFace>
+FaceExtractor::extract(std::span<unsigned char const> data,
+                       cv::Mat const& detect_image,
+                       std::vector<Face> const& detected)
+{
+  cv::Size const size = full_image_size(read_image_size(data), detect_image.size(),
+                                        m_opts.detect_scale);
+  std::vector<Face> const faces = map_faces(detected, detect_image.size(), size);
+
+  std::vector<ExtractedFace> result;
+  result.reserve(faces.size());
+
+  if (m_opts.no_crops) {
+    for (Face const& face : faces) {
+      result.push_back(ExtractedFace{face, cv::Mat(), {}});
+    }
+    return result;
+  }
+
+  if (faces.empty()) {
+    return result;
+  }
+
+  if (!m_codec.decode(data, extract_decode_flag(m_opts, data, faces), m_image)) {
+    throw std::runtime_error("failed to decode image");
+  }
+
+  std::vector<Face> crop_rects;
+  for (Face const& face : faces)
+  {
+    if (std::optional<Face> const mapped = map_face(face, size, m_image.size())) {
+      result.push_back(ExtractedFace{face, cv::Mat(), {}});
+      crop_rects.push_back(*mapped);
+    }
+  }
+
+  // a fresh tensor per call, the returned crops are views into it
+  cv::Mat tensor;
+  cv::Mat const crops = crop_faces(m_image, crop_rects, m_opts.inflate, m_opts.output_size, tensor);
+
+  int const height = m_opts.output_size.height;
+  for (size_t idx = 0; idx < result.size(); ++idx)
+  {
+    int const row = static_cast<int>(idx) * height;
+    result[idx].image = crops.rowRange(row, row + height);
+    if (!m_codec.encode(result[idx].image, result[idx].encoded)) {
+      throw std::runtime_error("failed to encode face crop");
+    }
+  }
+  return result;
+}
+
+} // namespace gesichtool
+
+/* EOF */
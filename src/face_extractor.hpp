@@ -0,0 +1,97 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_FACE_EXTRACTOR_HPP
+#define HEADER_GESICHTOOL_FACE_EXTRACTOR_HPP
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "face.hpp"
+#include "face_aligner.hpp"
+#include "face_detector.hpp"
+#include "image_codec.hpp"
+#include "options.hpp"
+
+namespace gesichtool {
+
+struct ExtractedFace
+{
+  /** Face rectangle in full resolution image coordinates */
+  Face face;
+
+  /** Crop of Options::output_size, the crops of one image share a
+      single contiguous tensor */
+  cv::Mat image;
+
+  /** The crop encoded in Options::output_format */
+  std::vector<unsigned char> encoded;
+};
+
+/** In-process API for embedding the face extraction into other
+    programs: takes an encoded image and returns its face crops, the
+    same ones the command line pipeline writes. 'opts' must outlive
+    the extractor. An extractor is not thread safe, use one per thread
+    and share a single factory between them so the models are only
+    loaded once. */
+class FaceExtractor
+{
+public:
+  explicit FaceExtractor(Options const& opts);
+  FaceExtractor(Options const& opts, FaceDetectorFactory const& make_detector);
+
+  /** Decodes 'data', throws std::runtime_error when it is not a
+      readable image or a crop can't be encoded */
+  std::vector<ExtractedFace> process(std::span<unsigned char const> data);
+
+  /** The steps of process() for callers that batch the detection:
+      decode() returns the detection image of 'data', detect() and
+      detect_batch() find faces in detection images, with landmarks
+      when Options::align_model is set, and extract() maps
+      them to full resolution and crops them. With Options::no_crops
+      extract() only fills in ExtractedFace::face. */
+  cv::Mat decode(std::span<unsigned char const> data);
+  std::vector<Face> detect(cv::Mat const& image);
+  std::vector<std::vector<Face>> detect_batch(std::vector<cv::Mat> const& images);
+  std::vector<ExtractedFace> extract(std::span<unsigned char const> data,
+                                     cv::Mat const& detect_image,
+                                     std::vector<Face> const& faces);
+
+  /** Images a detect_batch() call processes at once */
+  size_t batch_size() const;
+
+private:
+  Options const& m_opts;
+  std::unique_ptr<FaceDetector> m_detector;
+  std::optional<FaceAligner> m_aligner;
+  ImageCodec m_codec;
+  cv::Mat m_image;
+
+public:
+  FaceExtractor(FaceExtractor const&) = delete;
+  FaceExtractor& operator=(FaceExtractor const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
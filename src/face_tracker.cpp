@@ -0,0 +1,116 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "face_tracker.hpp"
+
+#include <dlib/opencv.h>
+
+namespace gesichtool {
+
+namespace {
+
+// peak-to-sidelobe ratio below which a track counts as lost
+constexpr double kMinTrackQuality = 7.0;
+
+// intersection over union above which a detection continues a track
+constexpr double kMinTrackOverlap = 0.3;
+
+double overlap(cv::Rect const& lhs, cv::Rect const& rhs)
+{
+  int const intersection = (lhs & rhs).area();
+  int const total = lhs.area() + rhs.area() - intersection;
+  return total > 0 ? static_cast<double>(intersection) / total : 0.0;
+}
+
+dlib::drectangle to_dlib(cv::Rect const& rect)
+{
+  return dlib::drectangle(rect.x, rect.y,
+                          rect.x + rect.width - 1,
+                          rect.y + rect.height - 1);
+}
+
+cv::Rect from_dlib(dlib::drectangle const& rect)
+{
+  return cv::Rect(static_cast<int>(rect.left()),
+                  static_cast<int>(rect.top()),
+                  static_cast<int>(rect.width()),
+                  static_cast<int>(rect.height()));
+}
+
+} // namespace
+
+FaceTracker::FaceTracker() :
+  m_tracks()
+{
+}
+
+std::vector<Face>
+FaceTracker::detected(cv::Mat const& gray, std::vector<Face> const& faces)
+{
+  dlib::cv_image<unsigned char> const image(gray);
+
+  // bring the tracks up to this frame before comparing
+  for (Track& track : m_tracks) {
+    track.tracker.update(image);
+    track.rect = from_dlib(track.tracker.get_position());
+  }
+
+  std::vector<Track> tracks;
+  std::vector<Face> new_faces;
+  for (Face const& face : faces)
+  {
+    auto best = m_tracks.end();
+    double best_overlap = kMinTrackOverlap;
+    for (auto it = m_tracks.begin(); it != m_tracks.end(); ++it) {
+      double const value = overlap(it->rect, face.rect);
+      if (value >= best_overlap) {
+        best = it;
+        best_overlap = value;
+      }
+    }
+
+    if (best == m_tracks.end()) {
+      new_faces.push_back(face);
+    } else {
+      // consumed, so that two detections can't continue the same track
+      best->rect = cv::Rect();
+    }
+
+    // (re)start the track on the detection to correct tracker drift
+    Track track{dlib::correlation_tracker(), face.rect};
+    track.tracker.start_track(image, to_dlib(face.rect));
+    tracks.push_back(std::move(track));
+  }
+
+  m_tracks = std::move(tracks);
+  return new_faces;
+}
+
+void
+FaceTracker::track(cv::Mat const& gray)
+{
+  dlib::cv_image<unsigned char> const image(gray);
+
+  std::erase_if(m_tracks, [&image](Track& track) {
+    double const quality = track.tracker.update(image);
+    track.rect = from_dlib(track.tracker.get_position());
+    return quality < kMinTrackQuality;
+  });
+}
+
+} // namespace gesichtool
+
+/* EOF */
@@ -0,0 +1,62 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_FACE_TRACKER_HPP
+#define HEADER_GESICHTOOL_FACE_TRACKER_HPP
+
+#include <vector>
+
+#include <dlib/image_processing/correlation_tracker.h>
+#include <opencv2/core/mat.hpp>
+
+#include "face.hpp"
+
+namespace gesichtool {
+
+/** Follows faces across video frames with dlib's correlation tracker,
+    so that the full detector only has to run on some of the frames
+    and a face that stays in view is only reported once. */
+class FaceTracker
+{
+public:
+  FaceTracker();
+
+  /** Feed the results of a full detection on 'gray', returns the
+      faces that did not match an existing track. Tracks that were
+      not confirmed by the detection are dropped. */
+  std::vector<Face> detected(cv::Mat const& gray, std::vector<Face> const& faces);
+
+  /** Advance the tracks to 'gray', drops tracks that were lost */
+  void track(cv::Mat const& gray);
+
+  bool empty() const { return m_tracks.empty(); }
+
+private:
+  struct Track
+  {
+    dlib::correlation_tracker tracker;
+    cv::Rect rect;
+  };
+
+private:
+  std::vector<Track> m_tracks;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
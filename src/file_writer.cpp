@@ -0,0 +1,118 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "file_writer.hpp"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <unistd.h>
+
+namespace gesichtool {
+
+FileWriter::FileWriter(bool sync) :
+  m_sync(sync),
+  m_pending_fds()
+{
+}
+
+FileWriter::~FileWriter()
+{
+  // only reached without flush() when the run failed anyway
+  for (int const fd : m_pending_fds) {
+    ::close(fd);
+  }
+}
+
+bool
+FileWriter::write(std::filesystem::path const& path, std::span<unsigned char const> data)
+{
+  int const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t const ret = ::write(fd, data.data() + written, data.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      int const err = errno;
+      ::close(fd);
+      errno = err;
+      return false;
+    }
+    written += static_cast<size_t>(ret);
+  }
+
+  if (!m_sync) {
+    return ::close(fd) == 0;
+  }
+
+  m_pending_fds.push_back(fd);
+  if (m_pending_fds.size() >= kSyncBatchSize) {
+    flush();
+  }
+  return true;
+}
+
+void
+FileWriter::flush()
+{
+  // every file is closed even after an error, the first error is reported
+  int err = 0;
+  for (int const fd : m_pending_fds) {
+    if (::fsync(fd) != 0 && err == 0) {
+      err = errno;
+    }
+    if (::close(fd) != 0 && err == 0) {
+      err = errno;
+    }
+  }
+  m_pending_fds.clear();
+
+  if (err != 0) {
+    throw std::system_error(err, std::generic_category(), "failed to sync written files");
+  }
+}
+
+void sync_directory(std::filesystem::path const& path)
+{
+  int const fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", path));
+  }
+
+  int err = ::fsync(fd) != 0 ? errno : 0;
+  if (::close(fd) != 0 && err == 0) {
+    err = errno;
+  }
+
+  if (err != 0) {
+    throw std::system_error(err, std::generic_category(), fmt::format("failed to sync {}", path));
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
@@ -0,0 +1,64 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_FILE_WRITER_HPP
+#define HEADER_GESICHTOOL_FILE_WRITER_HPP
+
+#include <filesystem>
+#include <span>
+#include <vector>
+
+namespace gesichtool {
+
+/** Writes whole files, optionally making them durable with fsync().
+    To avoid a disk flush per file, synced files are kept open and
+    fsync()ed in batches. */
+class FileWriter
+{
+public:
+  static constexpr size_t kSyncBatchSize = 64;
+
+public:
+  explicit FileWriter(bool sync);
+  ~FileWriter();
+
+  /** Returns false and sets errno on failure */
+  bool write(std::filesystem::path const& path, std::span<unsigned char const> data);
+
+  /** fsync() and close all files written so far, throws on error */
+  void flush();
+
+  /** Number of written files that wait for the next flush() */
+  size_t pending() const { return m_pending_fds.size(); }
+
+private:
+  bool m_sync;
+  std::vector<int> m_pending_fds;
+
+public:
+  FileWriter(FileWriter const&) = delete;
+  FileWriter& operator=(FileWriter const&) = delete;
+};
+
+/** fsync() a directory, so that newly created entries are durable,
+    throws on error */
+void sync_directory(std::filesystem::path const& path);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
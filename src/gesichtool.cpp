@@ -14,86 +14,187 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
-#include <future>
+#include <functional>
+#include <memory>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <optional>
-#include <semaphore>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-#include <dlib/image_processing/frontal_face_detector.h>
-#include <dlib/opencv.h>
 #include <fmt/format.h>
 #include <fmt/std.h>
 #include <opencv2/opencv.hpp>
 
-#include "semaphore_guard.hpp"
+#include "bounded_queue.hpp"
+#include "dedup_index.hpp"
+#include "detections_writer.hpp"
+#include "face.hpp"
+#include "face_detector.hpp"
+#include "face_aligner.hpp"
+#include "face_detectors.hpp"
+#include "face_tracker.hpp"
+#include "file_writer.hpp"
+#include "hash.hpp"
+#include "image_codec.hpp"
+#include "image_header.hpp"
+#include "input_data.hpp"
+#include "imaging.hpp"
+#include "input_source.hpp"
+#include "memory_budget.hpp"
+#include "object_pool.hpp"
+#include "options.hpp"
+#include "output_sink.hpp"
+#include "pipeline.hpp"
+#include "result_cache.hpp"
+#include "server.hpp"
+#include "stats.hpp"
 
 namespace gesichtool {
 
-void extract_faces(cv::Mat const& image, std::vector<cv::Rect> const& faces,
-                   int image_idx,
-                   std::filesystem::path const& output_directory,
-                   cv::Size const& output_size)
+struct FaceCrop
 {
-  int face_idx = 0;
-  for (cv::Rect const& face : faces)
-  {
-    // int const inflation = static_cast<int>(static_cast<double>(face.width) * 0.2);
-    int const inflation = 0;
-
-    cv::Rect enlarged_face(face.x - inflation,
-                           face.y - inflation,
-                           face.width + inflation * 2,
-                           face.height + inflation * 2);
-
-    if (enlarged_face.tl().x < 0 ||
-        enlarged_face.tl().y < 0 ||
-        enlarged_face.br().x >= image.cols ||
-        enlarged_face.br().y >= image.rows)
+  // relative to the output directory
+  std::string filename;
+
+  // a view into 'tensor', with ImageFormat::NPY the crops of all faces
+  cv::Mat image;
+  size_t faces;
+
+  // the crop tensor of the image, goes back to the pool once the last
+  // of its crops is encoded
+  std::shared_ptr<cv::Mat> tensor;
+
+  // set when the result cache is in use
+  std::shared_ptr<PendingResult> pending;
+
+  // --dedup hashes of the crops, persisted once they are written
+  std::vector<uint64_t> hashes;
+};
+
+// Crops and resizes the faces into one tensor and passes them on to
+// the writer threads as 'filenames', returns false if 'crop_queue' was
+// closed. The tensor comes from 'crop_pool' and is shared by the crops,
+// with ImageFormat::NPY it is passed on whole as filenames[0]. With
+// 'dedup' crops close to an earlier one are dropped before encoding.
+bool extract_faces(Options const& opts, cv::Mat const& image, std::vector<Face> const& faces,
+                   std::vector<std::string> const& filenames,
+                   ObjectPool<cv::Mat>& crop_pool,
+                   BoundedQueue<FaceCrop>& crop_queue,
+                   std::shared_ptr<PendingResult> const& pending,
+                   std::optional<DedupIndex>& dedup,
+                   std::optional<Stats>& stats)
+{
+  if (faces.empty()) {
+    return true;
+  }
+
+  if (opts.verbose) {
+    for (Face const& face : faces)
     {
-      fmt::print("  enlargement rejected\n");
-      enlarged_face = face;
+      fmt::print("  extracting face at: {} {} {} {} from {}x{}\n",
+                 face.rect.x, face.rect.y, face.rect.width, face.rect.height,
+                 image.cols, image.rows);
     }
+  }
 
-    fmt::print("extracting face at: {} {} {} {} from {}x{}\n",
-               enlarged_face.x,
-               enlarged_face.y,
-               enlarged_face.width,
-               enlarged_face.height,
-               image.cols, image.rows);
+  // tensors of images with unusually many faces are freed instead of
+  // pooled, so the pool doesn't keep their size around
+  int const max_pooled_rows = opts.output_size.height * 16;
+  std::shared_ptr<cv::Mat> const tensor(new cv::Mat(crop_pool.acquire()), [&crop_pool, max_pooled_rows](cv::Mat* mat) {
+    if (mat->rows <= max_pooled_rows) {
+      crop_pool.release(std::move(*mat));
+    }
+    delete mat;
+  });
 
-    cv::Mat face_image = image(enlarged_face);
+  cv::Mat crops;
+  {
+    StageTimer const timer(stats, Stage::RESIZE);
+    crops = crop_faces(image, faces, opts.inflate, opts.output_size, *tensor);
+  }
 
-    std::string const filename = output_directory / fmt::format("face{:03d}-{:03d}.jpg", image_idx, face_idx);
+  int const height = opts.output_size.height;
+  std::vector<size_t> kept;
+  std::vector<uint64_t> hashes;
+  kept.reserve(faces.size());
+  if (dedup) {
+    StageTimer const timer(stats, Stage::DEDUP);
+    for (size_t face_idx = 0; face_idx < faces.size(); ++face_idx)
+    {
+      int const row = static_cast<int>(face_idx) * height;
+      uint64_t const hash = dhash(crops.rowRange(row, row + height));
+      if (dedup->insert(hash)) {
+        kept.push_back(face_idx);
+        hashes.push_back(hash);
+      } else if (opts.verbose) {
+        fmt::print("  dropping near-duplicate {}\n",
+                   opts.output_format == ImageFormat::NPY ? fmt::format("{}[{}]", filenames[0], face_idx) : filenames[face_idx]);
+      }
+    }
 
-    cv::resize(face_image, face_image, output_size);
+    size_t const dropped = faces.size() - kept.size();
+    if (dropped != 0) {
+      if (stats) {
+        stats->count_duplicates(dropped);
+      }
+      // dropped faces count as written, so the image still completes
+      // in the result cache
+      if (pending) {
+        pending->faces_written(dropped);
+      }
+    }
+  } else {
+    for (size_t face_idx = 0; face_idx < faces.size(); ++face_idx) {
+      kept.push_back(face_idx);
+    }
+  }
 
-    cv::imwrite(filename, face_image);
+  if (kept.empty()) {
+    return true;
+  }
 
-    face_idx += 1;
+  if (opts.output_format == ImageFormat::NPY) {
+    // the kept crops move to the front, keeping their order
+    for (size_t idx = 0; idx < kept.size(); ++idx)
+    {
+      if (kept[idx] != idx) {
+        int const from = static_cast<int>(kept[idx]) * height;
+        int const to = static_cast<int>(idx) * height;
+        cv::Mat target = crops.rowRange(to, to + height);
+        crops.rowRange(from, from + height).copyTo(target);
+      }
+    }
+    return crop_queue.push(FaceCrop{filenames[0], crops.rowRange(0, static_cast<int>(kept.size()) * height),
+                                    kept.size(), tensor, pending, std::move(hashes)});
   }
-}
 
-enum class Mode
-{
-  DLIB,
-  OPENCV
-};
+  for (size_t idx = 0; idx < kept.size(); ++idx)
+  {
+    int const row = static_cast<int>(kept[idx]) * height;
+    std::vector<uint64_t> crop_hashes;
+    if (!hashes.empty()) {
+      crop_hashes.push_back(hashes[idx]);
+    }
+    if (!crop_queue.push(FaceCrop{filenames[kept[idx]], crops.rowRange(row, row + height),
+                                  1, tensor, pending, std::move(crop_hashes)})) {
+      return false;
+    }
+  }
+
+  return true;
+}
 
-struct Options
-{
-  Mode mode = Mode::DLIB;
-  std::vector<std::filesystem::path> images = {};
-  std::filesystem::path output_directory = {};
-  cv::Size output_size = cv::Size(512, 512);
-  std::optional<cv::Size> min_size = cv::Size(512, 512);
-  std::optional<cv::Size> max_size = {};
-  bool verbose = false;
-  int min_neighbors = 3;
-  double threshold = 0.0;
-};
 
 class ArgParseError : public std::runtime_error
 {
@@ -105,28 +206,120 @@ public:
 void print_help()
 {
   fmt::print(
-    "Usage: gesichtool [OPTIONS] IMAGE... -o OUTDIR\n"
+    "Usage: gesichtool [OPTIONS] IMAGE|DIR... -o OUTDIR\n"
+    "       gesichtool [OPTIONS] --serve SOCKET\n"
     "Extract faces from image files\n"
     "\n"
     "General Options:\n"
     "  -h, --help                Print this help\n"
     "  -v, --verbose             Be more verbose\n"
+    "  --stats                   Print throughput, per stage latencies, queue depths\n"
+    "                            and peak memory use at the end of the run\n"
+    "  --trace FILE              Write the stage timings as Chrome trace events\n"
+    "  --serve SOCKET            Keep the detectors loaded and extract faces from\n"
+    "                            images sent to the Unix socket SOCKET, one thread\n"
+    "                            per --jobs, --no-crops returns only rectangles\n"
+    "\n"
+    "Input Options:\n"
+    "  --input-list FILE         Read input files from FILE, one per line, '-' for stdin\n"
+    "  -0, --null                Entries in input lists are separated by NUL\n"
+    "  --shard INDEX/COUNT       Only process the inputs whose path hash falls into\n"
+    "                            shard INDEX of COUNT, use with --naming hash\n"
+    "  --mmap                    Map input files instead of reading them, the files\n"
+    "                            must not be truncated while running\n"
+    "  --readahead INT           Ask the kernel to start reading the next INT input\n"
+    "                            files early, for slow or network storage\n"
+    "  --largest-first           Hand out the largest file of the --readahead window\n"
+    "                            next, so huge images don't finish last\n"
+    "\n"
+    "Video Options:\n"
+    "  --frame-stride INT        Only look at every INT-th video frame (default: 1)\n"
+    "  --detect-interval INT     Run the detector on every INT-th frame looked at and\n"
+    "                            track faces in between (default: 10)\n"
+    "\n"
+    "Pipeline Options:\n"
+    "  -j, --jobs INT            Number of detector threads (default: number of cores)\n"
+    "  --decode-jobs INT         Number of image reading threads (default: jobs/2)\n"
+    "  --encode-jobs INT         Number of color decoding and cropping threads\n"
+    "                            (default: jobs/2)\n"
+    "  --write-jobs INT          Number of crop encoding and writing threads\n"
+    "                            (default: jobs/2)\n"
+    "  --queue-size INT          Images buffered between stages (default: jobs)\n"
+    "  --max-memory BYTES        Limit memory used by images in flight, e.g. 8G\n"
+    "  --cv-threads INT          Threads every OpenCV call may use internally\n"
+    "                            (default: cores/jobs)\n"
+    "  --pin-threads             Bind every pipeline thread to one CPU\n"
+    "  --fast-dct                Use the faster, slightly less accurate DCT and\n"
+    "                            chroma upsampling for JPEGs, needs TurboJPEG\n"
     "\n"
     "Face Detect Mode:\n"
     "  --dlib                    Use dlib face detection (default)\n"
     "  --opencv                  Use OpenCV face detection\n"
+    "  --dnn MODEL               Use an SSD face detection network with cv::dnn,\n"
+    "                            e.g. res10_300x300_ssd_iter_140000.caffemodel\n"
+    "  --dlib-cnn MODEL          Use dlib's CNN face detector,\n"
+    "                            e.g. mmod_human_face_detector.dat\n"
+    "\n"
+    "Face Detect Options:\n"
+    "  --detect-scale INT        Detect on an image reduced by 2, 4 or 8 (default: 1)\n"
+    "  --min-size WxH            Minimum sizes for detected faces (default: 512x512)\n"
+    "  --max-size WxH            Maximum sizes for detected faces\n"
+    "  --batch-size INT          Images per forward pass with --dnn and --dlib-cnn\n"
+    "                            (default: 8)\n"
+    "  --prefilter               Only run the detector on regions where a fast Haar\n"
+    "                            cascade finds face candidates\n"
+    "  --prefilter-scale INT     Further reduce the image for the prefilter by 1, 2\n"
+    "                            or 4 (default: 2)\n"
     "\n"
     "OpenCV Face Detect Options:\n"
     "  -n, --min-neighbors INT   Higher values reduce false positives (default: 3)\n"
-    "  --min-size WxH            Minimum sizes for detected faces\n"
-    "  --max-size WxH            Maximum sizes for detected faces\n"
+    "  --scale-factor FLOAT      Pyramid step, larger is faster but coarser (default: 1.1)\n"
     "\n"
     "dlib Face Detect Options:\n"
-    "  --threshold FLOAT         Detection threshold (default: 0.0)\n"
+    "  --threshold FLOAT         Detection threshold, also for --dlib-cnn (default: 0.0)\n"
+    "  --upsample INT            Upsample the image up to INT times to find faces\n"
+    "                            smaller than 80 pixels (default: 0)\n"
+    "\n"
+    "DNN Face Detect Options:\n"
+    "  --dnn-config FILE         Network description, e.g. deploy.prototxt\n"
+    "  --dnn-backend NAME        default, opencv, cuda or openvino (default: default)\n"
+    "  --dnn-target NAME         cpu, opencl, opencl-fp16, cuda or cuda-fp16\n"
+    "                            (default: cpu), every detect job loads its own\n"
+    "                            network, so limit --jobs when using a GPU\n"
+    "  --dnn-size WxH            Network input size (default: 300x300)\n"
+    "  --confidence FLOAT        Minimum detection confidence (default: 0.5)\n"
     "\n"
     "Output Options:\n"
     "  -o, --output DIR          Output directory\n"
     "  --size WxH         Rescale output images to WxH (default: 512x512)\n"
+    "  --format FORMAT           Output image format: jpg, png, webp or npy, npy\n"
+    "                            writes all faces of an image as one uint8 array of\n"
+    "                            faces x height x width x BGR (default: jpg)\n"
+    "  --quality INT             JPEG or WebP quality from 1 to 100 (default: 95)\n"
+    "  --png-compression INT     PNG compression level from 0 to 9\n"
+    "  --inflate FLOAT           Enlarge the crop by FLOAT times the face size on\n"
+    "                            every side, padded with black beyond the image\n"
+    "                            border (default: 0)\n"
+    "  --align MODEL             Rotate and scale the crops to the landmarks of a\n"
+    "                            dlib shape predictor, e.g.\n"
+    "                            shape_predictor_5_face_landmarks.dat\n"
+    "  --dedup INT               Drop crops within a Hamming distance of INT from 0\n"
+    "                            to 11 of the difference hash of an earlier crop\n"
+    "  --dedup-index FILE        Keep the --dedup hashes in FILE across runs\n"
+    "  --fsync                   Flush written files to disk before exiting\n"
+    "  --naming SCHEME           Name faces by input index or by a hash of the image\n"
+    "                            content and face rectangle, hash names don't\n"
+    "                            collide between runs: index or hash (default: index)\n"
+    "  --fanout INT              Spread hash named faces over INT levels of 256\n"
+    "                            subdirectories each (default: 0)\n"
+    "  --archive FORMAT          Write faces into tar or pack shards instead of files\n"
+    "  --shard-size BYTES        Start a new shard after BYTES (default: 1G)\n"
+    "  --detections FILE         Write face rectangles as JSON Lines to FILE, with\n"
+    "                            --cache new records are appended\n"
+    "  --no-crops                Don't extract faces, only write --detections\n"
+    "  --cache FILE              Record finished images in FILE and skip them when\n"
+    "                            they are unchanged on the next run, implies\n"
+    "                            --naming hash\n"
     );
 }
 
@@ -139,9 +332,69 @@ cv::Size to_size(std::string const& text)
   return size;
 }
 
+unsigned int to_count(std::string const& text)
+{
+  int const value = std::stoi(text);
+  if (value < 1) {
+    throw std::runtime_error(fmt::format("expected a positive integer, got {}", text));
+  }
+  return static_cast<unsigned int>(value);
+}
+
+size_t to_bytes(std::string const& text)
+{
+  size_t pos = 0;
+  unsigned long long const value = std::stoull(text, &pos);
+  std::string const suffix = text.substr(pos);
+  if (suffix.empty()) {
+    return value;
+  } else if (suffix == "K" || suffix == "k") {
+    return value << 10;
+  } else if (suffix == "M" || suffix == "m") {
+    return value << 20;
+  } else if (suffix == "G" || suffix == "g") {
+    return value << 30;
+  } else {
+    throw std::runtime_error(fmt::format("invalid size suffix in {}", text));
+  }
+}
+
+int to_dnn_backend(std::string const& text)
+{
+  if (text == "default") {
+    return cv::dnn::DNN_BACKEND_DEFAULT;
+  } else if (text == "opencv") {
+    return cv::dnn::DNN_BACKEND_OPENCV;
+  } else if (text == "cuda") {
+    return cv::dnn::DNN_BACKEND_CUDA;
+  } else if (text == "openvino") {
+    return cv::dnn::DNN_BACKEND_INFERENCE_ENGINE;
+  } else {
+    throw std::runtime_error(fmt::format("unknown DNN backend {}", text));
+  }
+}
+
+int to_dnn_target(std::string const& text)
+{
+  if (text == "cpu") {
+    return cv::dnn::DNN_TARGET_CPU;
+  } else if (text == "opencl") {
+    return cv::dnn::DNN_TARGET_OPENCL;
+  } else if (text == "opencl-fp16") {
+    return cv::dnn::DNN_TARGET_OPENCL_FP16;
+  } else if (text == "cuda") {
+    return cv::dnn::DNN_TARGET_CUDA;
+  } else if (text == "cuda-fp16") {
+    return cv::dnn::DNN_TARGET_CUDA_FP16;
+  } else {
+    throw std::runtime_error(fmt::format("unknown DNN target {}", text));
+  }
+}
+
 Options parse_args(std::vector<std::string> const& argv)
 {
   Options opts;
+  bool naming_given = false;
 
   for (size_t argv_idx = 0; argv_idx < argv.size(); ++argv_idx)
   {
@@ -159,195 +412,1262 @@ Options parse_args(std::vector<std::string> const& argv)
       else if (arg == "-v" || arg == "--verbose") {
         opts.verbose = true;
       }
-      else if (arg == "-h" || arg == "--help") {
-        print_help();
-        exit(EXIT_SUCCESS);
+      else if (arg == "--stats") {
+        opts.stats = true;
       }
-      else if (arg == "-n" || arg == "--min-neighbors") {
+      else if (arg == "--trace") {
         argv_idx += 1;
         if (argv_idx >= argv.size()) {
           throw ArgParseError(fmt::format("{} requires an argument", arg));
         }
 
-        try {
-          opts.min_neighbors = std::stoi(argv[argv_idx]);
-        } catch (std::exception const& err) {
-          std::throw_with_nested(ArgParseError(fmt::format("invalid value {} for argument", argv[argv_idx], arg)));
-        }
+        opts.trace_file = argv[argv_idx];
       }
-      else if (arg == "--min-size") {
+      else if (arg == "--serve") {
         argv_idx += 1;
         if (argv_idx >= argv.size()) {
           throw ArgParseError(fmt::format("{} requires an argument", arg));
         }
 
-        opts.min_size = to_size(argv[argv_idx]);
+        opts.serve_socket = argv[argv_idx];
       }
-      else if (arg == "--max-size") {
+      else if (arg == "--inflate") {
         argv_idx += 1;
         if (argv_idx >= argv.size()) {
           throw ArgParseError(fmt::format("{} requires an argument", arg));
         }
 
-        opts.max_size = to_size(argv[argv_idx]);
+        opts.inflate = std::stod(argv[argv_idx]);
+        if (opts.inflate < 0.0) {
+          throw ArgParseError(fmt::format("{} must not be negative", arg));
+        }
       }
-      else if (arg == "--threshold") {
+      else if (arg == "--align") {
         argv_idx += 1;
         if (argv_idx >= argv.size()) {
           throw ArgParseError(fmt::format("{} requires an argument", arg));
         }
 
-        opts.threshold = std::stod(argv[argv_idx]);
+        opts.align_model = argv[argv_idx];
       }
-      else if (arg == "--size") {
+      else if (arg == "--dedup") {
         argv_idx += 1;
         if (argv_idx >= argv.size()) {
           throw ArgParseError(fmt::format("{} requires an argument", arg));
         }
 
-        opts.output_size = to_size(argv[argv_idx]);
+        opts.dedup_distance = std::stoi(argv[argv_idx]);
+        if (*opts.dedup_distance < 0 || *opts.dedup_distance > DedupIndex::kMaxDistance) {
+          throw ArgParseError(fmt::format("{} must be between 0 and {}", arg, DedupIndex::kMaxDistance));
+        }
       }
-      else if (arg == "--opencv") {
-        opts.mode = Mode::OPENCV;
+      else if (arg == "--dedup-index") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.dedup_index = argv[argv_idx];
       }
-      else if (arg == "--dlib") {
-        opts.mode = Mode::DLIB;
+      else if (arg == "--fast-dct") {
+        opts.fast_dct = true;
       }
-      else {
-        throw ArgParseError(fmt::format("unknown argument {} given", arg));
+      else if (arg == "--mmap") {
+        opts.mmap_input = true;
       }
-    }
-    else
-    {
-      opts.images.emplace_back(arg);
-    }
-  }
-
-  if (opts.images.empty()) {
-    throw ArgParseError("no input images given");
-  }
-
-  if (opts.output_directory.empty()) {
-    throw ArgParseError("no output directory given");
-  }
-
-  return opts;
-}
+      else if (arg == "--readahead") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-void run_dlib(Options const& opts)
-{
-  fmt::print("running dlib face detection\n");
+        opts.readahead = to_count(argv[argv_idx]);
+      }
+      else if (arg == "--largest-first") {
+        opts.largest_first = true;
+      }
+      else if (arg == "-h" || arg == "--help") {
+        print_help();
+        exit(EXIT_SUCCESS);
+      }
+      else if (arg == "-j" || arg == "--jobs") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-  std::counting_semaphore sem(std::thread::hardware_concurrency());
-  std::vector<std::future<void>> futures;
-  for (size_t images_idx = 0; images_idx < opts.images.size(); ++images_idx)
-  {
-    futures.push_back(std::async(std::launch::async, [&sem, images_idx, &opts]{
-      SemaphoreGuard guard(sem);
+        opts.jobs = to_count(argv[argv_idx]);
+      }
+      else if (arg == "--decode-jobs") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      std::filesystem::path const& input_image_path = opts.images[images_idx];
+        opts.decode_jobs = to_count(argv[argv_idx]);
+      }
+      else if (arg == "--encode-jobs") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      if (opts.verbose) {
-        fmt::print("processing {}\n", input_image_path);
+        opts.encode_jobs = to_count(argv[argv_idx]);
       }
+      else if (arg == "--write-jobs") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      // not thread safe, so recreate it each thread
-      dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+        opts.write_jobs = to_count(argv[argv_idx]);
+      }
+      else if (arg == "--queue-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      cv::Mat const image = cv::imread(input_image_path);
-      cv::Mat gray;
-      cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+        opts.queue_size = to_count(argv[argv_idx]);
+      }
+      else if (arg == "--input-list") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      dlib::cv_image<unsigned char> const dlibImage(gray);
+        opts.input_lists.emplace_back(argv[argv_idx]);
+      }
+      else if (arg == "-0" || arg == "--null") {
+        opts.null_separated = true;
+      }
+      else if (arg == "--shard") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      std::vector<dlib::rectangle> const dlib_faces = detector(dlibImage, opts.threshold);
+        if (sscanf(argv[argv_idx].c_str(), "%zu/%zu", &opts.shard.index, &opts.shard.count) != 2 ||
+            opts.shard.count == 0 || opts.shard.index >= opts.shard.count) {
+          throw ArgParseError(fmt::format("{} expects INDEX/COUNT with INDEX < COUNT", arg));
+        }
+      }
+      else if (arg == "--frame-stride") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      std::vector<cv::Rect> faces;
-      for (auto const& rect : dlib_faces)
-      {
-        faces.emplace_back(static_cast<int>(rect.left()),
-                           static_cast<int>(rect.top()),
-                           static_cast<int>(rect.width()),
-                           static_cast<int>(rect.height()));
+        opts.frame_stride = to_count(argv[argv_idx]);
       }
+      else if (arg == "--detect-interval") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      extract_faces(image, faces,
-                    images_idx,
-                    opts.output_directory,
-                    opts.output_size);
-    }));
-  }
+        opts.detect_interval = to_count(argv[argv_idx]);
+      }
+      else if (arg == "-n" || arg == "--min-neighbors") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-  fmt::print("waiting for results\n");
-  for (auto& future : futures) {
-    future.get();
-  }
-}
+        try {
+          opts.min_neighbors = std::stoi(argv[argv_idx]);
+        } catch (std::exception const& err) {
+          std::throw_with_nested(ArgParseError(fmt::format("invalid value {} for argument", argv[argv_idx], arg)));
+        }
+      }
+      else if (arg == "--min-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-void run_opencv(Options const& opts)
-{
-  fmt::print("running OpenCV face detection\n");
+        opts.min_size = to_size(argv[argv_idx]);
+      }
+      else if (arg == "--max-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-  std::string const cascade_file = cv::samples::findFile("haarcascades/haarcascade_frontalface_default.xml");
+        opts.max_size = to_size(argv[argv_idx]);
+      }
+      else if (arg == "--threshold") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-  std::counting_semaphore sem(std::thread::hardware_concurrency());
-  std::vector<std::future<void>> futures;
-  for (size_t images_idx = 0; images_idx < opts.images.size(); ++images_idx)
-  {
-    std::filesystem::path const& input_image_path = opts.images[images_idx];
+        opts.threshold = std::stod(argv[argv_idx]);
+      }
+      else if (arg == "--prefilter") {
+        opts.prefilter = true;
+      }
+      else if (arg == "--prefilter-scale") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-    if (opts.verbose) {
-      fmt::print("processing {}\n", input_image_path);
-    }
+        opts.prefilter_scale = std::stoi(argv[argv_idx]);
+        if (opts.prefilter_scale != 1 && opts.prefilter_scale != 2 && opts.prefilter_scale != 4) {
+          throw ArgParseError(fmt::format("{} must be 1, 2 or 4", arg));
+        }
+      }
+      else if (arg == "--scale-factor") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-    futures.push_back(std::async(std::launch::async, [&sem, images_idx, &input_image_path, &opts, &cascade_file]{
-      SemaphoreGuard guard(sem);
+        opts.scale_factor = std::stod(argv[argv_idx]);
+        if (opts.scale_factor <= 1.0) {
+          throw ArgParseError(fmt::format("{} must be larger than 1.0", arg));
+        }
+      }
+      else if (arg == "--upsample") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      // CascadeClassifier is neither thread safe nor can it be copied
-      cv::CascadeClassifier face_cascade;
-      if (!face_cascade.load(cascade_file)) {
-        throw std::runtime_error(fmt::format("failed to load {}", cascade_file));
+        opts.upsample = std::stoi(argv[argv_idx]);
+        if (opts.upsample < 0 || opts.upsample > 3) {
+          throw ArgParseError(fmt::format("{} must be between 0 and 3", arg));
+        }
       }
+      else if (arg == "--size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-      cv::Mat image = cv::imread(input_image_path);
-      if (image.empty()) {
-        fmt::print(stderr, "error: failed to read image: {}\n", input_image_path);
-      } else {
-        std::vector<cv::Rect> faces;
-        face_cascade.detectMultiScale(image, faces, 1.1, opts.min_neighbors, 0,
-                                      opts.min_size.value_or(cv::Size()),
-                                      opts.max_size.value_or(cv::Size()));
+        opts.output_size = to_size(argv[argv_idx]);
+      }
+      else if (arg == "--max-memory") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-        extract_faces(image, faces,
-                      images_idx,
-                      opts.output_directory,
-                      opts.output_size);
+        opts.max_memory = to_bytes(argv[argv_idx]);
+      }
+      else if (arg == "--cv-threads") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-        fmt::print("  detected {}\n", faces.size());
+        opts.cv_threads = to_count(argv[argv_idx]);
       }
-    }));
-  }
+      else if (arg == "--pin-threads") {
+        opts.pin_threads = true;
+      }
+      else if (arg == "--detect-scale") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-  fmt::print("waiting for results\n");
-  for (auto& future : futures) {
-    future.get();
-  }
-}
+        opts.detect_scale = std::stoi(argv[argv_idx]);
+        if (opts.detect_scale != 1 && opts.detect_scale != 2 &&
+            opts.detect_scale != 4 && opts.detect_scale != 8) {
+          throw ArgParseError(fmt::format("{} must be 1, 2, 4 or 8", arg));
+        }
+      }
+      else if (arg == "--format") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
 
-void run(Options const& opts)
+        std::string const& format = argv[argv_idx];
+        if (format == "jpg" || format == "jpeg") {
+          opts.output_format = ImageFormat::JPEG;
+        } else if (format == "png") {
+          opts.output_format = ImageFormat::PNG;
+        } else if (format == "webp") {
+          opts.output_format = ImageFormat::WEBP;
+        } else if (format == "npy") {
+          opts.output_format = ImageFormat::NPY;
+        } else {
+          throw ArgParseError(fmt::format("unknown output format {}", format));
+        }
+      }
+      else if (arg == "--quality") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.quality = std::stoi(argv[argv_idx]);
+        if (opts.quality < 1 || opts.quality > 100) {
+          throw ArgParseError(fmt::format("{} must be between 1 and 100", arg));
+        }
+      }
+      else if (arg == "--png-compression") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.png_compression = std::stoi(argv[argv_idx]);
+        if (*opts.png_compression < 0 || *opts.png_compression > 9) {
+          throw ArgParseError(fmt::format("{} must be between 0 and 9", arg));
+        }
+      }
+      else if (arg == "--fsync") {
+        opts.fsync = true;
+      }
+      else if (arg == "--detections") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.detections_file = argv[argv_idx];
+      }
+      else if (arg == "--no-crops") {
+        opts.no_crops = true;
+      }
+      else if (arg == "--cache") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.cache_file = argv[argv_idx];
+      }
+      else if (arg == "--archive") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        std::string const& format = argv[argv_idx];
+        if (format == "tar") {
+          opts.archive = ArchiveFormat::TAR;
+        } else if (format == "pack") {
+          opts.archive = ArchiveFormat::PACK;
+        } else {
+          throw ArgParseError(fmt::format("unknown archive format {}", format));
+        }
+      }
+      else if (arg == "--naming") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        naming_given = true;
+        std::string const& scheme = argv[argv_idx];
+        if (scheme == "index") {
+          opts.naming = Naming::INDEX;
+        } else if (scheme == "hash") {
+          opts.naming = Naming::HASH;
+        } else {
+          throw ArgParseError(fmt::format("unknown naming scheme {}", scheme));
+        }
+      }
+      else if (arg == "--fanout") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.fanout = std::stoi(argv[argv_idx]);
+        if (opts.fanout < 0 || opts.fanout > 4) {
+          throw ArgParseError(fmt::format("{} must be between 0 and 4", arg));
+        }
+      }
+      else if (arg == "--shard-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.shard_size = to_bytes(argv[argv_idx]);
+      }
+      else if (arg == "--opencv") {
+        opts.mode = Mode::OPENCV;
+      }
+      else if (arg == "--dlib") {
+        opts.mode = Mode::DLIB;
+      }
+      else if (arg == "--dnn") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.mode = Mode::DNN;
+        opts.dnn_model = argv[argv_idx];
+      }
+      else if (arg == "--dlib-cnn") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.mode = Mode::DLIB_CNN;
+        opts.dlib_cnn_model = argv[argv_idx];
+      }
+      else if (arg == "--dnn-config") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.dnn_config = argv[argv_idx];
+      }
+      else if (arg == "--dnn-backend") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.dnn_backend = to_dnn_backend(argv[argv_idx]);
+      }
+      else if (arg == "--dnn-target") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.dnn_target = to_dnn_target(argv[argv_idx]);
+      }
+      else if (arg == "--dnn-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.dnn_input_size = to_size(argv[argv_idx]);
+      }
+      else if (arg == "--confidence") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.confidence = std::stod(argv[argv_idx]);
+      }
+      else if (arg == "--batch-size") {
+        argv_idx += 1;
+        if (argv_idx >= argv.size()) {
+          throw ArgParseError(fmt::format("{} requires an argument", arg));
+        }
+
+        opts.batch_size = to_count(argv[argv_idx]);
+      }
+      else {
+        throw ArgParseError(fmt::format("unknown argument {} given", arg));
+      }
+    }
+    else
+    {
+      opts.images.emplace_back(arg);
+    }
+  }
+
+  if (!opts.align_model.empty() && opts.output_size.width != opts.output_size.height) {
+    throw ArgParseError("--align needs a square --size");
+  }
+
+  // with index names a rerun over a grown or reordered input would
+  // number the images differently and overwrite earlier faces
+  if (!opts.cache_file.empty()) {
+    if (naming_given && opts.naming == Naming::INDEX) {
+      throw ArgParseError("--cache needs --naming hash");
+    }
+    opts.naming = Naming::HASH;
+  }
+
+  if (opts.largest_first && opts.readahead == 0) {
+    throw ArgParseError("--largest-first needs --readahead");
+  }
+
+  if (!opts.dedup_index.empty() && !opts.dedup_distance) {
+    throw ArgParseError("--dedup-index needs --dedup");
+  }
+
+  if (!opts.serve_socket.empty()) {
+    // images arrive over the socket and the crops go back over it
+    if (!opts.images.empty() || !opts.input_lists.empty()) {
+      throw ArgParseError("--serve doesn't take input images");
+    }
+    return opts;
+  }
+
+  if (opts.images.empty() && opts.input_lists.empty()) {
+    throw ArgParseError("no input images given");
+  }
+
+  if (opts.no_crops) {
+    if (opts.detections_file.empty()) {
+      throw ArgParseError("--no-crops requires --detections");
+    }
+  } else if (opts.output_directory.empty()) {
+    throw ArgParseError("no output directory given");
+  }
+
+  return opts;
+}
+
+
+struct DecodedImage
 {
-  std::filesystem::create_directory(opts.output_directory);
+  InputFile input;
+  MemoryReservation reservation;
+
+  // the encoded file, decoded again in color for extraction
+  InputData data;
 
-  switch (opts.mode)
+  // image for detection, reduced by Options::detect_scale, grayscale
+  // unless the detector needs color
+  cv::Mat image;
+
+  // size of the full resolution image
+  cv::Size image_size;
+
+  // set when the result cache is in use
+  std::optional<std::string> cache_key;
+};
+
+struct DetectedImage
+{
+  InputFile input;
+  MemoryReservation reservation;
+  InputData data;
+
+  // already decoded full resolution color image, used instead of
+  // 'data' for video frames and images detected in color
+  cv::Mat image;
+
+  // filename prefix for the extracted faces with Naming::INDEX
+  std::string name;
+
+  // identifies the image for Naming::HASH
+  uint64_t source_hash;
+
+  // faces in full resolution coordinates
+  cv::Size image_size;
+  std::vector<Face> faces;
+
+  std::optional<std::string> cache_key;
+
+  // shared by the frames of a video with the result cache, the faces
+  // of the frame are already announced to it
+  std::shared_ptr<PendingResult> pending;
+};
+
+// File buffers are pooled up to this capacity, larger ones are freed
+// so a few huge inputs don't stay allocated outside of --max-memory
+constexpr size_t kMaxPooledDataSize = size_t{16} << 20;
+
+void release_data(ObjectPool<std::vector<unsigned char>>& data_pool, std::vector<unsigned char> buffer)
+{
+  if (buffer.capacity() <= kMaxPooledDataSize) {
+    data_pool.release(std::move(buffer));
+  }
+}
+
+// Estimates the peak memory needed to process an image: the encoded
+// file, the detection image, the color image and a crop
+size_t estimate_image_memory(Options const& opts, size_t data_size,
+                             std::optional<cv::Size> const& image_size)
+{
+  if (!image_size) {
+    // assume 10:1 compression when the header can't be read
+    return data_size + data_size * 10 * 4 / 3;
+  }
+
+  size_t const pixels = static_cast<size_t>(image_size->width) * static_cast<size_t>(image_size->height);
+  size_t const scale = static_cast<size_t>(opts.detect_scale);
+  size_t const crop_pixels = static_cast<size_t>(opts.output_size.area());
+  size_t const detect_channels = detects_in_color(opts) ? 3 : 1;
+
+  return data_size + detect_channels * pixels / (scale * scale) + pixels * 3 + crop_pixels * 3;
+}
+
+// Hashes all options that affect the detections or the written faces
+// and where they go, results from a run with different options or
+// another output directory or detections file are not reused
+uint64_t config_hash(Options const& opts)
+{
+  auto const size_text = [](std::optional<cv::Size> const& size) {
+    return size ? fmt::format("{}x{}", size->width, size->height) : std::string("none");
+  };
+
+  // 'out' and './out/' name the same target
+  auto const path_text = [](std::filesystem::path const& path) {
+    if (path.empty()) {
+      return std::string("none");
+    }
+    std::filesystem::path target = std::filesystem::absolute(path).lexically_normal();
+    if (!target.has_filename() && target.has_relative_path()) {
+      target = target.parent_path();
+    }
+    return target.string();
+  };
+
+  return fnv1a(fmt::format("mode={} threshold={} upsample={} min-neighbors={} scale-factor={} "
+                           "min-size={} max-size={} "
+                           "detect-scale={} fast-dct={} size={} format={} quality={} png-compression={} "
+                           "archive={} naming={} fanout={} no-crops={} prefilter={} dnn-model={} dnn-config={} dnn-size={} "
+                           "confidence={} dlib-cnn-model={} inflate={} align={} dedup={} "
+                           "frame-stride={} detect-interval={} output={} detections={}",
+                           static_cast<int>(opts.mode), opts.threshold, opts.upsample,
+                           opts.min_neighbors, opts.scale_factor,
+                           size_text(opts.min_size), size_text(opts.max_size),
+                           opts.detect_scale, opts.fast_dct, size_text(opts.output_size),
+                           static_cast<int>(opts.output_format), opts.quality,
+                           opts.png_compression.value_or(-1),
+                           static_cast<int>(opts.archive), static_cast<int>(opts.naming),
+                           opts.fanout, opts.no_crops,
+                           opts.prefilter && opts.mode != Mode::OPENCV ? opts.prefilter_scale : 0,
+                           opts.dnn_model, opts.dnn_config, size_text(opts.dnn_input_size),
+                           opts.confidence, opts.dlib_cnn_model, opts.inflate, opts.align_model,
+                           opts.dedup_distance.value_or(-1),
+                           opts.frame_stride, opts.detect_interval,
+                           opts.no_crops ? std::string("none") : path_text(opts.output_directory),
+                           path_text(opts.detections_file)));
+}
+
+
+// Each writer thread gets its own sink, so archive shards are written
+// sequentially without locking
+std::unique_ptr<OutputSink> make_output_sink(Options const& opts, unsigned int writer_idx)
+{
+  std::string const basename = fmt::format("faces-{:02d}", writer_idx);
+
+  switch (opts.archive)
   {
-    case Mode::OPENCV:
-      run_opencv(opts);
-      break;
+    case ArchiveFormat::TAR:
+      return std::make_unique<TarSink>(opts.output_directory, basename, opts.shard_size, opts.fsync);
+
+    case ArchiveFormat::PACK:
+      return std::make_unique<PackSink>(opts.output_directory, basename, opts.shard_size, opts.fsync);
+
+    default:
+      return std::make_unique<DirectorySink>(opts.output_directory, opts.fsync);
+  }
+}
+
+// Spreads hash names over Options::fanout levels of subdirectories
+std::string hashed_filename(Options const& opts, uint64_t hash_value)
+{
+  std::string const hash = fmt::format("{:016x}", hash_value);
+
+  std::string filename;
+  for (int level = 0; level < opts.fanout; ++level) {
+    filename += hash.substr(static_cast<size_t>(level) * 2, 2);
+    filename += '/';
+  }
+  filename += hash;
+  filename += file_extension(opts.output_format);
+  return filename;
+}
 
-    case Mode::DLIB:
-      run_dlib(opts);
-      break;
+// Returns the output filename of a face, 'face' is in full resolution
+// coordinates. Hash names only depend on the image and the rectangle,
+// so independent runs writing into one directory never collide.
+std::string face_filename(Options const& opts, DetectedImage const& detected,
+                          Face const& face, size_t face_idx)
+{
+  if (opts.naming == Naming::INDEX) {
+    return fmt::format("{}-{:03d}{}", detected.name, face_idx, file_extension(opts.output_format));
   }
+
+  cv::Rect const& rect = face.rect;
+  return hashed_filename(opts, fnv1a(fmt::format("{},{},{},{}", rect.x, rect.y, rect.width, rect.height),
+                                     detected.source_hash));
+}
+
+// Returns the output filename for all faces of an image with
+// ImageFormat::NPY
+std::string tensor_filename(Options const& opts, DetectedImage const& detected)
+{
+  if (opts.naming == Naming::INDEX) {
+    return fmt::format("{}{}", detected.name, file_extension(opts.output_format));
+  }
+
+  return hashed_filename(opts, detected.source_hash);
+}
+
+// Detects faces in a video file, capture device or stream. Only every
+// Options::detect_interval-th frame looked at runs the full detector,
+// the frames in between just follow the known faces with a tracker,
+// and a face is only extracted when it isn't tracked already. Returns
+// the number of extracted faces or std::nullopt when the pipeline was
+// aborted.
+std::optional<size_t> process_video(Options const& opts, InputFile const& input,
+                                    FaceDetector& detector,
+                                    std::optional<FaceAligner> const& aligner,
+                                    std::optional<DetectionsWriter>& detections_writer,
+                                    std::optional<Stats>& stats,
+                                    std::shared_ptr<PendingResult> const& pending,
+                                    BoundedQueue<DetectedImage>& detected_queue)
+{
+  cv::VideoCapture capture(input.path.string());
+  if (!capture.isOpened()) {
+    fmt::print(stderr, "error: failed to open video: {}\n", input.path);
+    return 0;
+  }
+
+  FaceTracker tracker;
+  cv::Mat frame;
+  cv::Mat gray;
+  cv::Mat detect_image;
+  cv::Mat color_image;
+  size_t extracted = 0;
+  size_t processed = 0;
+  for (size_t frame_idx = 0; capture.grab(); ++frame_idx)
+  {
+    // frames off the stride are grabbed but never converted
+    if (frame_idx % opts.frame_stride != 0) {
+      continue;
+    }
+
+    {
+      StageTimer const timer(stats, Stage::DECODE);
+      if (!capture.retrieve(frame) || frame.empty()) {
+        continue;
+      }
+
+      cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+      if (opts.detect_scale != 1) {
+        cv::resize(gray, detect_image, cv::Size(), 1.0 / opts.detect_scale, 1.0 / opts.detect_scale, cv::INTER_AREA);
+      } else {
+        detect_image = gray;
+      }
+    }
+
+    std::vector<Face> new_faces;
+    if (processed % opts.detect_interval == 0) {
+      if (detects_in_color(opts)) {
+        cv::resize(frame, color_image, detect_image.size(), 0.0, 0.0, cv::INTER_AREA);
+      }
+
+      std::vector<Face> const faces = timed(stats, Stage::DETECT, [&]{
+        return detector.detect(detects_in_color(opts) ? color_image : detect_image);
+      });
+      if (stats) {
+        stats->count_image();
+        stats->count_faces(faces.size());
+      }
+      if (detections_writer) {
+        detections_writer->write(input.path, frame.size(),
+                                 map_faces(faces, detect_image.size(), frame.size()),
+                                 frame_idx);
+      }
+      new_faces = tracker.detected(detect_image, faces);
+    } else if (!tracker.empty()) {
+      tracker.track(detect_image);
+    }
+    processed += 1;
+
+    if (new_faces.empty()) {
+      continue;
+    }
+
+    if (opts.verbose) {
+      fmt::print("  detected {} new in {} frame {}\n", new_faces.size(), input.path, frame_idx);
+    }
+
+    extracted += new_faces.size();
+    if (opts.no_crops) {
+      continue;
+    }
+
+    if (aligner) {
+      StageTimer const timer(stats, Stage::ALIGN);
+      aligner->add_landmarks(detect_image, new_faces);
+    }
+
+    // 'frame' is reused by retrieve(), so the queued image needs its own copy
+    // frames have no file content of their own, so their hash comes
+    // from the video path and frame number
+    uint64_t const source_hash = opts.naming == Naming::HASH
+      ? fnv1a(fmt::format("{}#{}", std::filesystem::absolute(input.path), frame_idx))
+      : 0;
+    std::vector<Face> frame_faces = map_faces(new_faces, detect_image.size(), frame.size());
+    if (pending) {
+      pending->add_faces(frame_faces.size());
+    }
+    if (!detected_queue.push(DetectedImage{input, {}, {}, frame.clone(),
+                                           fmt::format("face{:03d}-{:06d}", input.idx, frame_idx),
+                                           source_hash,
+                                           frame.size(),
+                                           std::move(frame_faces),
+                                           std::nullopt,
+                                           pending})) {
+      return std::nullopt;
+    }
+  }
+
+  return extracted;
+}
+
+unsigned int get_jobs(Options const& opts)
+{
+  if (opts.jobs != 0) {
+    return opts.jobs;
+  }
+
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// OpenCV runs resize, color conversion and cv::dnn on a thread pool of
+// its own, with every detector thread doing the same the cores end up
+// oversubscribed, so OpenCV only gets the cores left per job
+void configure_opencv_threads(Options const& opts)
+{
+  unsigned int const cv_threads = opts.cv_threads != 0
+    ? opts.cv_threads
+    : std::max(1u, std::thread::hardware_concurrency() / get_jobs(opts));
+  cv::setNumThreads(static_cast<int>(cv_threads));
+}
+
+// Runs the images through three thread groups connected by bounded
+// queues: decoding, face detection and face extraction. Slow disk or
+// network I/O in the first and last stage thus overlaps with
+// detection instead of stalling the detector threads.
+void run_pipeline(Options const& opts, FaceDetectorFactory const& make_detector)
+{
+  unsigned int const detect_jobs = get_jobs(opts);
+  unsigned int const decode_jobs = opts.decode_jobs != 0 ? opts.decode_jobs : std::max(1u, detect_jobs / 2);
+  unsigned int const encode_jobs = opts.encode_jobs != 0 ? opts.encode_jobs : std::max(1u, detect_jobs / 2);
+  unsigned int const write_jobs = opts.write_jobs != 0 ? opts.write_jobs : std::max(1u, detect_jobs / 2);
+  unsigned int const queue_size = opts.queue_size != 0 ? opts.queue_size : detect_jobs;
+
+  BoundedQueue<DecodedImage> decoded_queue(queue_size);
+  BoundedQueue<DetectedImage> detected_queue(queue_size);
+  BoundedQueue<FaceCrop> crop_queue(queue_size * 4);
+
+  std::optional<MemoryBudget> memory_budget;
+  if (opts.max_memory != 0) {
+    memory_budget.emplace(opts.max_memory);
+  }
+
+  // file, grayscale and crop tensor buffers are handed between stages,
+  // so instead of per-thread buffers they are recycled through pools
+  ObjectPool<std::vector<unsigned char>> data_pool(2 * queue_size + decode_jobs + detect_jobs + encode_jobs);
+  ObjectPool<cv::Mat> gray_pool(queue_size + decode_jobs + detect_jobs);
+  ObjectPool<cv::Mat> crop_pool(queue_size * 4 + encode_jobs + write_jobs);
+
+  std::optional<DetectionsWriter> detections_writer;
+  if (!opts.detections_file.empty()) {
+    // images skipped through the cache keep their earlier records
+    detections_writer.emplace(opts.detections_file, !opts.cache_file.empty());
+  }
+
+  std::optional<Stats> stats;
+  if (opts.stats || !opts.trace_file.empty()) {
+    stats.emplace(!opts.trace_file.empty());
+  }
+
+  std::optional<ResultCache> result_cache;
+  if (!opts.cache_file.empty()) {
+    result_cache.emplace(opts.cache_file, config_hash(opts));
+  }
+
+  // shared, the shape predictor is only read from
+  std::optional<FaceAligner> aligner;
+  if (!opts.align_model.empty()) {
+    aligner.emplace(opts.align_model);
+  }
+
+  // shared by the encode threads, so duplicates are caught across images
+  std::optional<DedupIndex> dedup;
+  if (opts.dedup_distance) {
+    dedup.emplace(*opts.dedup_distance, opts.dedup_index);
+  }
+
+  InputSource input_source(opts.images, opts.input_lists, opts.null_separated, opts.shard);
+
+  std::optional<InputReadahead> readahead;
+  if (opts.readahead != 0) {
+    readahead.emplace(input_source, opts.readahead, opts.largest_first);
+  }
+
+  Pipeline pipeline(opts.pin_threads);
+  pipeline.on_abort([&decoded_queue]{ decoded_queue.close(); });
+  pipeline.on_abort([&detected_queue]{ detected_queue.close(); });
+  pipeline.on_abort([&crop_queue]{ crop_queue.close(); });
+  if (memory_budget) {
+    pipeline.on_abort([&memory_budget]{ memory_budget->close(); });
+  }
+
+  pipeline.add_stage(decode_jobs, [&opts, &make_detector, &aligner, &input_source, &readahead, &memory_budget, &detections_writer, &result_cache, &stats, &data_pool, &gray_pool, &decoded_queue, &detected_queue]{
+    // only created once this thread comes across a video
+    std::unique_ptr<FaceDetector> video_detector;
+    ImageCodec codec(opts);
+
+    while (std::optional<InputFile> input = readahead ? readahead->next() : input_source.next())
+    {
+      // copied, 'input' is moved into the DecodedImage below
+      std::filesystem::path const input_image_path = input->path;
+
+      std::optional<std::string> cache_key;
+      if (result_cache) {
+        cache_key = result_cache->make_key(input_image_path);
+        if (cache_key && result_cache->contains(*cache_key)) {
+          if (opts.verbose) {
+            fmt::print("skipping unchanged {}\n", input_image_path);
+          }
+          continue;
+        }
+      }
+
+      if (opts.verbose) {
+        fmt::print("processing {}\n", input_image_path);
+      }
+
+      // videos bypass the decode and detect stages, frames with new
+      // faces go straight to extraction
+      if (is_video_input(input_image_path)) {
+        if (!video_detector) {
+          video_detector = make_detector();
+        }
+
+        // the number of faces is only known at the end of the video,
+        // the entry is added once the last of its crops is durable
+        std::shared_ptr<PendingResult> pending;
+        if (result_cache && cache_key && !opts.no_crops) {
+          pending = std::make_shared<PendingResult>(*result_cache, *cache_key);
+        }
+
+        std::optional<size_t> const extracted = process_video(opts, *input, *video_detector, aligner,
+                                                              detections_writer, stats, pending,
+                                                              detected_queue);
+        if (!extracted) {
+          return;
+        }
+
+        if (pending) {
+          pending->finish();
+        } else if (result_cache && cache_key) {
+          // nothing in flight without crops
+          result_cache->add(*cache_key, *extracted);
+        }
+        continue;
+      }
+
+      // detection only needs a possibly reduced image straight from
+      // the decoder, full resolution color is only decoded from the
+      // kept file data once faces were found
+      DecodedImage decoded{std::move(*input), {}, InputData(data_pool.acquire()), gray_pool.acquire(), {}, std::move(cache_key)};
+      if (!timed(stats, Stage::READ, [&]{ return decoded.data.load(input_image_path, opts.mmap_input); })) {
+        fmt::print(stderr, "error: failed to read image: {}\n", input_image_path);
+        release_data(data_pool, decoded.data.take_buffer());
+        gray_pool.release(std::move(decoded.image));
+        continue;
+      }
+
+      std::optional<cv::Size> const header_size = read_image_size(decoded.data.span());
+
+      // block until the image fits into the budget, the size comes
+      // from the header, so nothing big has been allocated yet
+      if (memory_budget) {
+        size_t const bytes = estimate_image_memory(opts, decoded.data.size(), header_size);
+        if (!memory_budget->acquire(bytes)) {
+          return;
+        }
+        decoded.reservation = MemoryReservation(*memory_budget, bytes);
+      }
+
+      bool const decoded_ok = timed(stats, Stage::DECODE, [&]{
+        return codec.decode(decoded.data.span(), detect_decode_flag(opts), decoded.image);
+      });
+      if (!decoded_ok) {
+        fmt::print(stderr, "error: failed to read image: {}\n", input_image_path);
+        release_data(data_pool, decoded.data.take_buffer());
+        gray_pool.release(std::move(decoded.image));
+        continue;
+      }
+
+      decoded.image_size = full_image_size(header_size, decoded.image.size(), opts.detect_scale);
+
+      if (!decoded_queue.push(std::move(decoded))) {
+        return;
+      }
+    }
+  }, [&decoded_queue]{ decoded_queue.close(); });
+
+  pipeline.add_stage(detect_jobs, [&opts, &make_detector, &aligner, &detections_writer, &result_cache, &stats, &data_pool, &gray_pool, &decoded_queue, &detected_queue]{
+    std::unique_ptr<FaceDetector> const detector = make_detector();
+    std::vector<DecodedImage> batch;
+    std::vector<cv::Mat> batch_images;
+
+    // returns false when the pipeline was aborted
+    auto const push_detected = [&](DecodedImage& decoded, std::vector<Face> detect_faces) {
+      // the landmarks come from the detection image as well, so the
+      // color image is still only decoded once for the crops
+      if (aligner) {
+        StageTimer const timer(stats, Stage::ALIGN);
+        aligner->add_landmarks(decoded.image, detect_faces);
+      }
+
+      std::vector<Face> faces = map_faces(detect_faces, decoded.image.size(), decoded.image_size);
+
+      // a full resolution color detection image is all extraction
+      // needs, so it is passed on instead of being decoded again
+      bool const keep_image = detects_in_color(opts) && decoded.image.size() == decoded.image_size &&
+        !faces.empty() && !opts.no_crops;
+      if (!keep_image) {
+        gray_pool.release(std::move(decoded.image));
+      }
+
+      if (opts.verbose) {
+        fmt::print("  detected {} in {}\n", faces.size(), decoded.input.path);
+      }
+
+      if (stats) {
+        stats->count_image();
+        stats->count_faces(faces.size());
+      }
+
+      if (detections_writer) {
+        detections_writer->write(decoded.input.path, decoded.image_size, faces);
+      }
+
+      if (faces.empty() || opts.no_crops) {
+        if (result_cache && decoded.cache_key) {
+          result_cache->add(*decoded.cache_key, faces.size());
+        }
+        release_data(data_pool, decoded.data.take_buffer());
+        return true;
+      }
+
+      std::string name = fmt::format("face{:03d}", decoded.input.idx);
+      uint64_t const source_hash = opts.naming == Naming::HASH ? fnv1a(decoded.data.span()) : 0;
+      if (keep_image) {
+        release_data(data_pool, decoded.data.take_buffer());
+      }
+      return detected_queue.push(DetectedImage{std::move(decoded.input),
+                                               std::move(decoded.reservation),
+                                               std::move(decoded.data),
+                                               keep_image ? std::move(decoded.image) : cv::Mat(),
+                                               std::move(name),
+                                               source_hash,
+                                               decoded.image_size,
+                                               std::move(faces),
+                                               std::move(decoded.cache_key),
+                                               nullptr});
+    };
+
+    while (std::optional<DecodedImage> first = decoded_queue.pop())
+    {
+      if (stats) {
+        stats->sample_queue(QueueId::DECODED, decoded_queue.size());
+      }
+
+      // only batch what is already queued, waiting for a full batch
+      // would stall the pipeline when images trickle in
+      batch.clear();
+      batch.push_back(std::move(*first));
+      while (batch.size() < detector->batch_size()) {
+        std::optional<DecodedImage> next = decoded_queue.try_pop();
+        if (!next) {
+          break;
+        }
+        batch.push_back(std::move(*next));
+      }
+
+      batch_images.clear();
+      for (DecodedImage const& decoded : batch) {
+        batch_images.push_back(decoded.image);
+      }
+      std::vector<std::vector<Face>> const batch_faces = timed(stats, Stage::DETECT, [&]{
+        return detector->detect_batch(batch_images);
+      });
+      batch_images.clear();
+
+      for (size_t batch_idx = 0; batch_idx < batch.size(); ++batch_idx)
+      {
+        if (!push_detected(batch[batch_idx], batch_faces[batch_idx])) {
+          return;
+        }
+      }
+    }
+  }, [&detected_queue]{ detected_queue.close(); });
+
+  pipeline.add_stage(encode_jobs, [&opts, &result_cache, &dedup, &stats, &data_pool, &crop_pool, &detected_queue, &crop_queue]{
+    // scratch buffer, reused for every image this thread handles
+    cv::Mat image;
+    ImageCodec codec(opts);
+
+    while (std::optional<DetectedImage> detected = detected_queue.pop())
+    {
+      if (stats) {
+        stats->sample_queue(QueueId::DETECTED, detected_queue.size());
+      }
+
+      bool decoded = true;
+      if (!detected->image.empty()) {
+        image = detected->image;
+      } else {
+        int const flag = extract_decode_flag(opts, detected->data.span(), detected->faces);
+        decoded = timed(stats, Stage::COLOR_DECODE, [&]{
+          return codec.decode(detected->data.span(), flag, image);
+        });
+        release_data(data_pool, detected->data.take_buffer());
+      }
+
+      if (!decoded) {
+        fmt::print(stderr, "error: failed to decode image: {}\n", detected->input.path);
+        continue;
+      }
+
+      std::vector<Face> faces;
+      std::vector<std::string> filenames;
+      for (size_t face_idx = 0; face_idx < detected->faces.size(); ++face_idx)
+      {
+        Face const& face = detected->faces[face_idx];
+        if (std::optional<Face> const mapped = map_face(face, detected->image_size, image.size())) {
+          faces.push_back(*mapped);
+          filenames.push_back(face_filename(opts, *detected, face, face_idx));
+        }
+      }
+
+      if (opts.output_format == ImageFormat::NPY) {
+        filenames = { tensor_filename(opts, *detected) };
+      }
+
+      // the image counts as done once its last face is written
+      std::shared_ptr<PendingResult> pending = detected->pending;
+      if (pending) {
+        // video frames announced all of their faces, including those
+        // that don't map into the image
+        if (faces.size() < detected->faces.size()) {
+          pending->faces_written(detected->faces.size() - faces.size());
+        }
+      } else if (result_cache && detected->cache_key) {
+        if (faces.empty()) {
+          result_cache->add(*detected->cache_key, 0);
+        } else {
+          pending = std::make_shared<PendingResult>(*result_cache, *detected->cache_key, faces.size());
+        }
+      }
+
+      if (!extract_faces(opts, image, faces, filenames,
+                         crop_pool, crop_queue, pending, dedup, stats)) {
+        return;
+      }
+    }
+  }, [&crop_queue]{ crop_queue.close(); });
+
+  // encoding and file creation happen here, so slow output storage
+  // doesn't hold up the extraction threads
+  std::atomic<unsigned int> next_writer_idx = 0;
+  pipeline.add_stage(write_jobs, [&opts, &next_writer_idx, &dedup, &stats, &crop_queue]{
+    std::unique_ptr<OutputSink> const sink = make_output_sink(opts, next_writer_idx++);
+    ImageCodec codec(opts);
+    std::vector<unsigned char> encoded;
+
+    while (std::optional<FaceCrop> crop = crop_queue.pop())
+    {
+      if (stats) {
+        stats->sample_queue(QueueId::CROPS, crop_queue.size());
+      }
+
+      bool const encoded_ok = timed(stats, Stage::ENCODE, [&]{
+        return codec.encode(crop->image, encoded);
+      });
+      crop->image.release();
+      crop->tensor.reset();
+      if (!encoded_ok) {
+        fmt::print(stderr, "error: failed to encode {}\n", crop->filename);
+        continue;
+      }
+
+      // the image only counts as done in the cache once the sink
+      // made its faces durable, e.g. closed the archive shard, the
+      // same goes for their --dedup-index entries
+      std::function<void()> on_durable;
+      if (crop->pending || !crop->hashes.empty()) {
+        on_durable = [&dedup, pending = std::move(crop->pending), faces = crop->faces,
+                      hashes = std::move(crop->hashes)]{
+          if (!hashes.empty()) {
+            dedup->persist(hashes);
+          }
+          if (pending) {
+            pending->faces_written(faces);
+          }
+        };
+      }
+
+      {
+        StageTimer const timer(stats, Stage::WRITE);
+        sink->write(crop->filename, encoded, std::move(on_durable));
+      }
+    }
+
+    sink->finish();
+  }, []{});
+
+  fmt::print("waiting for results\n");
+  pipeline.wait();
+
+  if (opts.fsync && !opts.no_crops) {
+    sync_directory(opts.output_directory);
+  }
+
+  if (detections_writer) {
+    // only reached when nothing failed, so a missing record means the
+    // shard has to be run again
+    if (opts.shard.count > 1) {
+      detections_writer->write_shard_complete(opts.shard.index, opts.shard.count,
+                                              input_source.produced());
+    }
+    detections_writer->close();
+  }
+
+  if (stats) {
+    if (opts.stats) {
+      stats->print_summary();
+    }
+
+    if (!opts.trace_file.empty()) {
+      stats->write_trace(opts.trace_file);
+    }
+  }
+}
+
+
+std::string_view mode_name(Mode mode)
+{
+  switch (mode)
+  {
+    case Mode::OPENCV: return "OpenCV";
+    case Mode::DNN: return "DNN";
+    case Mode::DLIB_CNN: return "dlib CNN";
+    default: return "dlib";
+  }
+}
+
+void run(Options const& opts)
+{
+  configure_opencv_threads(opts);
+
+  if (!opts.serve_socket.empty()) {
+    fmt::print("serving {} face detection\n", mode_name(opts.mode));
+    serve(opts, opts.serve_socket, make_face_detector_factory(opts), get_jobs(opts));
+    return;
+  }
+
+  if (!opts.no_crops) {
+    std::filesystem::create_directory(opts.output_directory);
+  }
+
+  fmt::print("running {} face detection\n", mode_name(opts.mode));
+
+  run_pipeline(opts, make_face_detector_factory(opts));
 }
 
 int main(int argc, char* argv[])
@@ -0,0 +1,45 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_HASH_HPP
+#define HEADER_GESICHTOOL_HASH_HPP
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace gesichtool {
+
+/** 64-bit FNV-1a, stable across runs and machines */
+inline uint64_t fnv1a(std::span<unsigned char const> data, uint64_t hash = 0xcbf29ce484222325ull)
+{
+  for (unsigned char const byte : data) {
+    hash ^= byte;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+inline uint64_t fnv1a(std::string_view text, uint64_t hash = 0xcbf29ce484222325ull)
+{
+  return fnv1a(std::span(reinterpret_cast<unsigned char const*>(text.data()), text.size()), hash);
+}
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,238 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "image_codec.hpp"
+
+#include <string>
+
+#include <fmt/format.h>
+#include <opencv2/opencv.hpp>
+
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+#  include <turbojpeg.h>
+#endif
+
+#include "image_header.hpp"
+#include "imaging.hpp"
+
+namespace gesichtool {
+
+namespace {
+
+// Writes a crop tensor as NPY version 1.0 array of shape
+// (crops, height, width, channels), uint8 in OpenCV's BGR order
+bool encode_npy(cv::Mat const& crops, int crop_height, std::vector<unsigned char>& encoded)
+{
+  if (crops.depth() != CV_8U || !crops.isContinuous() || crop_height <= 0 ||
+      crops.rows % crop_height != 0) {
+    return false;
+  }
+
+  std::string header = fmt::format("{{'descr': '|u1', 'fortran_order': False, 'shape': ({}, {}, {}, {}), }}",
+                                   crops.rows / crop_height, crop_height, crops.cols, crops.channels());
+
+  // magic, version and length take 10 bytes, the header is padded
+  // with spaces and ends in a newline so the data is 64 byte aligned
+  size_t const unpadded = 10 + header.size() + 1;
+  header.append((64 - unpadded % 64) % 64, ' ');
+  header += '\n';
+
+  size_t const data_size = crops.total() * crops.elemSize();
+  encoded.clear();
+  encoded.reserve(10 + header.size() + data_size);
+  encoded.insert(encoded.end(), { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0 });
+  encoded.push_back(static_cast<unsigned char>(header.size() & 0xff));
+  encoded.push_back(static_cast<unsigned char>(header.size() >> 8));
+  encoded.insert(encoded.end(), header.begin(), header.end());
+  encoded.insert(encoded.end(), crops.data, crops.data + data_size);
+  return true;
+}
+
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+// the same transformations cv::imdecode() does for the EXIF orientation
+void apply_orientation(cv::Mat& image, int orientation)
+{
+  switch (orientation)
+  {
+    case 2: cv::flip(image, image, 1); break;
+    case 3: cv::flip(image, image, -1); break;
+    case 4: cv::flip(image, image, 0); break;
+    case 5: cv::transpose(image, image); break;
+    case 6: cv::transpose(image, image); cv::flip(image, image, 1); break;
+    case 7: cv::transpose(image, image); cv::flip(image, image, -1); break;
+    case 8: cv::transpose(image, image); cv::flip(image, image, 0); break;
+    default: break;
+  }
+}
+#endif
+
+} // namespace
+
+ImageCodec::ImageCodec(Options const& opts) :
+  m_opts(opts),
+  m_extension(file_extension(opts.output_format)),
+  m_params(encode_params(opts)),
+  m_decompressor(nullptr),
+  m_compressor(nullptr),
+  m_jpeg_buffer(nullptr),
+  m_jpeg_buffer_size(0)
+{
+}
+
+ImageCodec::~ImageCodec()
+{
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+  if (m_decompressor != nullptr) {
+    tjDestroy(m_decompressor);
+  }
+  if (m_compressor != nullptr) {
+    tjDestroy(m_compressor);
+  }
+  if (m_jpeg_buffer != nullptr) {
+    tjFree(m_jpeg_buffer);
+  }
+#endif
+}
+
+bool
+ImageCodec::decode(std::span<unsigned char const> data, int flag, cv::Mat& image)
+{
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+  if (is_jpeg(data) && decode_jpeg(data, flag, image)) {
+    return true;
+  }
+#endif
+
+  // on failure imdecode() leaves 'dst' untouched, so check the return value
+  return !cv::imdecode(encoded_mat(data), flag, &image).empty();
+}
+
+bool
+ImageCodec::encode(cv::Mat const& image, std::vector<unsigned char>& encoded)
+{
+  if (m_opts.output_format == ImageFormat::NPY) {
+    return encode_npy(image, m_opts.output_size.height, encoded);
+  }
+
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+  if (m_opts.output_format == ImageFormat::JPEG && encode_jpeg(image, encoded)) {
+    return true;
+  }
+#endif
+
+  return cv::imencode(m_extension, image, encoded, m_params);
+}
+
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+bool
+ImageCodec::decode_jpeg(std::span<unsigned char const> data, int flag, cv::Mat& image)
+{
+  bool gray = false;
+  int denom = 1;
+  switch (flag)
+  {
+    case cv::IMREAD_GRAYSCALE: gray = true; break;
+    case cv::IMREAD_REDUCED_GRAYSCALE_2: gray = true; denom = 2; break;
+    case cv::IMREAD_REDUCED_GRAYSCALE_4: gray = true; denom = 4; break;
+    case cv::IMREAD_REDUCED_GRAYSCALE_8: gray = true; denom = 8; break;
+    case cv::IMREAD_COLOR: break;
+    case cv::IMREAD_REDUCED_COLOR_2: denom = 2; break;
+    case cv::IMREAD_REDUCED_COLOR_4: denom = 4; break;
+    case cv::IMREAD_REDUCED_COLOR_8: denom = 8; break;
+    default: return false;
+  }
+
+  if (m_decompressor == nullptr) {
+    m_decompressor = tjInitDecompress();
+    if (m_decompressor == nullptr) {
+      return false;
+    }
+  }
+
+  int width = 0;
+  int height = 0;
+  int subsamp = 0;
+  int colorspace = 0;
+  if (tjDecompressHeader3(m_decompressor, data.data(), static_cast<unsigned long>(data.size()),
+                          &width, &height, &subsamp, &colorspace) != 0) {
+    return false;
+  }
+
+  // rounds up like libjpeg's scale_denom that OpenCV uses
+  tjscalingfactor const scale{1, denom};
+  int const scaled_width = TJSCALED(width, scale);
+  int const scaled_height = TJSCALED(height, scale);
+
+  image.create(scaled_height, scaled_width, gray ? CV_8UC1 : CV_8UC3);
+
+  int const tj_flags = m_opts.fast_dct ? (TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) : 0;
+  if (tjDecompress2(m_decompressor, data.data(), static_cast<unsigned long>(data.size()),
+                    image.data, scaled_width, static_cast<int>(image.step),
+                    scaled_height, gray ? TJPF_GRAY : TJPF_BGR, tj_flags) != 0 &&
+      tjGetErrorCode(m_decompressor) != TJERR_WARNING) {
+    // like libjpeg in OpenCV, corrupt data warnings still give an image
+    return false;
+  }
+
+  apply_orientation(image, read_jpeg_orientation(data));
+  return true;
+}
+
+bool
+ImageCodec::encode_jpeg(cv::Mat const& image, std::vector<unsigned char>& encoded)
+{
+  if (image.depth() != CV_8U || (image.channels() != 1 && image.channels() != 3)) {
+    return false;
+  }
+
+  if (m_compressor == nullptr) {
+    m_compressor = tjInitCompress();
+    if (m_compressor == nullptr) {
+      return false;
+    }
+  }
+
+  bool const gray = image.channels() == 1;
+  int const subsamp = gray ? TJSAMP_GRAY : TJSAMP_420;
+
+  // sized for the worst case, so TurboJPEG never has to reallocate
+  unsigned long const needed = tjBufSize(image.cols, image.rows, subsamp);
+  if (m_jpeg_buffer_size < needed) {
+    tjFree(m_jpeg_buffer);
+    m_jpeg_buffer = tjAlloc(static_cast<int>(needed));
+    m_jpeg_buffer_size = m_jpeg_buffer != nullptr ? needed : 0;
+    if (m_jpeg_buffer == nullptr) {
+      return false;
+    }
+  }
+
+  unsigned long size = m_jpeg_buffer_size;
+  int const tj_flags = TJFLAG_NOREALLOC | (m_opts.fast_dct ? TJFLAG_FASTDCT : 0);
+  if (tjCompress2(m_compressor, image.data, image.cols, static_cast<int>(image.step),
+                  image.rows, gray ? TJPF_GRAY : TJPF_BGR,
+                  &m_jpeg_buffer, &size, subsamp, m_opts.quality, tj_flags) != 0) {
+    return false;
+  }
+
+  encoded.assign(m_jpeg_buffer, m_jpeg_buffer + size);
+  return true;
+}
+#endif
+
+} // namespace gesichtool
+
+/* EOF */
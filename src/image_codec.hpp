@@ -0,0 +1,79 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_IMAGE_CODEC_HPP
+#define HEADER_GESICHTOOL_IMAGE_CODEC_HPP
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "options.hpp"
+
+namespace gesichtool {
+
+/** Decodes input images and encodes crops. When built with TurboJPEG
+    (GESICHTOOL_HAVE_TURBOJPEG), JPEGs bypass OpenCV's codec layer and
+    go straight to libjpeg-turbo, where the reduced decodes use DCT
+    scaling and Options::fast_dct selects the faster integer DCT and
+    chroma upsampling. Everything else, and JPEGs TurboJPEG rejects,
+    goes through cv::imdecode() and cv::imencode(). Not thread safe,
+    every thread keeps its own codec. */
+class ImageCodec
+{
+public:
+  explicit ImageCodec(Options const& opts);
+  ~ImageCodec();
+
+  /** Decodes like cv::imdecode() with an IMREAD_* 'flag', including
+      the EXIF orientation, returns false on failure */
+  bool decode(std::span<unsigned char const> data, int flag, cv::Mat& image);
+
+  /** Encodes a crop in Options::output_format, returns false on
+      failure. For ImageFormat::NPY 'image' may also be a tensor of
+      several crops from crop_faces(). */
+  bool encode(cv::Mat const& image, std::vector<unsigned char>& encoded);
+
+private:
+#ifdef GESICHTOOL_HAVE_TURBOJPEG
+  bool decode_jpeg(std::span<unsigned char const> data, int flag, cv::Mat& image);
+  bool encode_jpeg(cv::Mat const& image, std::vector<unsigned char>& encoded);
+#endif
+
+private:
+  Options const& m_opts;
+  std::string m_extension;
+  std::vector<int> m_params;
+
+  // TurboJPEG handles and the compression buffer, created on first use
+  void* m_decompressor;
+  void* m_compressor;
+  unsigned char* m_jpeg_buffer;
+  unsigned long m_jpeg_buffer_size;
+
+public:
+  ImageCodec(ImageCodec const&) = delete;
+  ImageCodec& operator=(ImageCodec const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,242 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "image_header.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace gesichtool {
+
+namespace {
+
+uint32_t read_be16(unsigned char const* p)
+{
+  return (uint32_t{p[0]} << 8) | uint32_t{p[1]};
+}
+
+uint32_t read_be32(unsigned char const* p)
+{
+  return (read_be16(p) << 16) | read_be16(p + 2);
+}
+
+uint32_t read_le16(unsigned char const* p)
+{
+  return uint32_t{p[0]} | (uint32_t{p[1]} << 8);
+}
+
+uint32_t read_le24(unsigned char const* p)
+{
+  return read_le16(p) | (uint32_t{p[2]} << 16);
+}
+
+uint32_t read_le32(unsigned char const* p)
+{
+  return read_le24(p) | (uint32_t{p[3]} << 24);
+}
+
+bool starts_with(std::span<unsigned char const> data, size_t offset, char const* magic)
+{
+  size_t const len = strlen(magic);
+  return data.size() >= offset + len && memcmp(data.data() + offset, magic, len) == 0;
+}
+
+std::optional<cv::Size> make_size(uint32_t width, uint32_t height)
+{
+  if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) {
+    return std::nullopt;
+  }
+  return cv::Size(static_cast<int>(width), static_cast<int>(height));
+}
+
+std::optional<cv::Size> read_jpeg_size(std::span<unsigned char const> data)
+{
+  size_t pos = 2;
+  while (pos + 4 <= data.size())
+  {
+    if (data[pos] != 0xff) {
+      return std::nullopt;
+    }
+
+    unsigned char const marker = data[pos + 1];
+    if (marker == 0xff) {
+      // fill byte
+      pos += 1;
+      continue;
+    }
+
+    // markers without a length field
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9)) {
+      pos += 2;
+      continue;
+    }
+
+    uint32_t const length = read_be16(data.data() + pos + 2);
+
+    // SOF0 - SOF15, excluding DHT, JPG and DAC
+    if (marker >= 0xc0 && marker <= 0xcf &&
+        marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+    {
+      if (pos + 9 > data.size()) {
+        return std::nullopt;
+      }
+      return make_size(read_be16(data.data() + pos + 7),
+                       read_be16(data.data() + pos + 5));
+    }
+
+    pos += 2 + length;
+  }
+
+  return std::nullopt;
+}
+
+// 'tiff' is the TIFF structure in an EXIF segment, only IFD0 is
+// looked at, that's where the orientation is stored
+int read_tiff_orientation(std::span<unsigned char const> tiff)
+{
+  if (tiff.size() < 8) {
+    return 1;
+  }
+
+  bool const little_endian = starts_with(tiff, 0, "II");
+  if (!little_endian && !starts_with(tiff, 0, "MM")) {
+    return 1;
+  }
+
+  auto const read16 = [&](size_t offset) {
+    return little_endian ? read_le16(tiff.data() + offset) : read_be16(tiff.data() + offset);
+  };
+  auto const read32 = [&](size_t offset) {
+    return little_endian ? read_le32(tiff.data() + offset) : read_be32(tiff.data() + offset);
+  };
+
+  size_t const ifd = read32(4);
+  if (ifd + 2 > tiff.size()) {
+    return 1;
+  }
+
+  uint32_t const count = read16(ifd);
+  for (uint32_t idx = 0; idx < count; ++idx)
+  {
+    size_t const entry = ifd + 2 + idx * 12;
+    if (entry + 12 > tiff.size()) {
+      break;
+    }
+
+    // tag 0x0112 of type SHORT
+    if (read16(entry) == 0x0112 && read16(entry + 2) == 3) {
+      uint32_t const orientation = read16(entry + 8);
+      return orientation >= 1 && orientation <= 8 ? static_cast<int>(orientation) : 1;
+    }
+  }
+
+  return 1;
+}
+
+std::optional<cv::Size> read_webp_size(std::span<unsigned char const> data)
+{
+  if (starts_with(data, 12, "VP8 ") && data.size() >= 30) {
+    return make_size(read_le16(data.data() + 26) & 0x3fff,
+                     read_le16(data.data() + 28) & 0x3fff);
+  } else if (starts_with(data, 12, "VP8L") && data.size() >= 25) {
+    unsigned char const* p = data.data() + 21;
+    return make_size(1 + (uint32_t{p[0]} | ((uint32_t{p[1]} & 0x3f) << 8)),
+                     1 + ((uint32_t{p[1]} >> 6) | (uint32_t{p[2]} << 2) | ((uint32_t{p[3]} & 0x0f) << 10)));
+  } else if (starts_with(data, 12, "VP8X") && data.size() >= 30) {
+    return make_size(1 + read_le24(data.data() + 24),
+                     1 + read_le24(data.data() + 27));
+  } else {
+    return std::nullopt;
+  }
+}
+
+} // namespace
+
+std::optional<cv::Size> read_image_size(std::span<unsigned char const> data)
+{
+  if (starts_with(data, 0, "\xff\xd8")) {
+    return read_jpeg_size(data);
+  } else if (starts_with(data, 0, "\x89PNG\r\n\x1a\n") && starts_with(data, 12, "IHDR") && data.size() >= 24) {
+    return make_size(read_be32(data.data() + 16), read_be32(data.data() + 20));
+  } else if ((starts_with(data, 0, "GIF87a") || starts_with(data, 0, "GIF89a")) && data.size() >= 10) {
+    return make_size(read_le16(data.data() + 6), read_le16(data.data() + 8));
+  } else if (starts_with(data, 0, "BM") && data.size() >= 26) {
+    // height is negative for top-down bitmaps
+    int32_t const height = static_cast<int32_t>(read_le32(data.data() + 22));
+    return make_size(read_le32(data.data() + 18),
+                     static_cast<uint32_t>(std::abs(height)));
+  } else if (starts_with(data, 0, "RIFF") && starts_with(data, 8, "WEBP")) {
+    return read_webp_size(data);
+  } else {
+    return std::nullopt;
+  }
+}
+
+bool is_jpeg(std::span<unsigned char const> data)
+{
+  return starts_with(data, 0, "\xff\xd8");
+}
+
+int read_jpeg_orientation(std::span<unsigned char const> data)
+{
+  if (!is_jpeg(data)) {
+    return 1;
+  }
+
+  size_t pos = 2;
+  while (pos + 4 <= data.size())
+  {
+    if (data[pos] != 0xff) {
+      return 1;
+    }
+
+    unsigned char const marker = data[pos + 1];
+    if (marker == 0xff) {
+      pos += 1;
+      continue;
+    }
+
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9)) {
+      pos += 2;
+      continue;
+    }
+
+    // the EXIF segment comes before the scan data
+    if (marker == 0xda) {
+      return 1;
+    }
+
+    uint32_t const length = read_be16(data.data() + pos + 2);
+
+    // APP1 with "Exif\0\0" followed by the TIFF structure
+    if (marker == 0xe1 && length >= 8 && starts_with(data, pos + 4, "Exif") &&
+        pos + 10 <= data.size() && data[pos + 8] == 0 && data[pos + 9] == 0)
+    {
+      size_t const end = std::min(data.size(), pos + 2 + length);
+      return read_tiff_orientation(data.subspan(pos + 10, end - (pos + 10)));
+    }
+
+    pos += 2 + length;
+  }
+
+  return 1;
+}
+
+} // namespace gesichtool
+
+/* EOF */
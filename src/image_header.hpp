@@ -0,0 +1,43 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_IMAGE_HEADER_HPP
+#define HEADER_GESICHTOOL_IMAGE_HEADER_HPP
+
+#include <optional>
+#include <span>
+
+#include <opencv2/core/types.hpp>
+
+namespace gesichtool {
+
+/** Read the image dimensions from the file header without decoding
+    the image, supports JPEG, PNG, GIF, BMP and WebP. Returns
+    std::nullopt for unknown or truncated files. */
+std::optional<cv::Size> read_image_size(std::span<unsigned char const> data);
+
+/** Whether 'data' starts with the JPEG start of image marker */
+bool is_jpeg(std::span<unsigned char const> data);
+
+/** Returns the EXIF orientation tag of a JPEG file, 1 to 8, or 1 when
+    there is none */
+int read_jpeg_orientation(std::span<unsigned char const> data);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,261 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "imaging.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+#include <opencv2/opencv.hpp>
+
+#include "face_detectors.hpp"
+#include "image_header.hpp"
+
+namespace gesichtool {
+
+cv::Mat encoded_mat(std::span<unsigned char const> data)
+{
+  return cv::Mat(1, static_cast<int>(data.size()), CV_8UC1,
+                 const_cast<unsigned char*>(data.data()));
+}
+
+int detect_decode_flag(Options const& opts)
+{
+  if (detects_in_color(opts)) {
+    switch (opts.detect_scale)
+    {
+      case 2: return cv::IMREAD_REDUCED_COLOR_2;
+      case 4: return cv::IMREAD_REDUCED_COLOR_4;
+      case 8: return cv::IMREAD_REDUCED_COLOR_8;
+      default: return cv::IMREAD_COLOR;
+    }
+  }
+
+  switch (opts.detect_scale)
+  {
+    case 2: return cv::IMREAD_REDUCED_GRAYSCALE_2;
+    case 4: return cv::IMREAD_REDUCED_GRAYSCALE_4;
+    case 8: return cv::IMREAD_REDUCED_GRAYSCALE_8;
+    default: return cv::IMREAD_GRAYSCALE;
+  }
+}
+
+// Returns the imdecode() flag for the color image the faces are
+// extracted from. When even the smallest face is at least twice the
+// output size, libjpeg's scaled IDCT decodes at 1/2, 1/4 or 1/8 of the
+// size, which costs a fraction of a full decode and leaves cv::resize
+// with less than a 2:1 reduction. OpenCV implements the reduced flags
+// for other formats by decoding in full and resizing the whole image,
+// so those are decoded as they are.
+int extract_decode_flag(Options const& opts, std::span<unsigned char const> data,
+                        std::vector<Face> const& faces)
+{
+  if (faces.empty() || !is_jpeg(data)) {
+    return cv::IMREAD_COLOR;
+  }
+
+  double min_ratio = std::numeric_limits<double>::max();
+  for (Face const& face : faces)
+  {
+    min_ratio = std::min({min_ratio,
+                          static_cast<double>(face.rect.width) / opts.output_size.width,
+                          static_cast<double>(face.rect.height) / opts.output_size.height});
+  }
+
+  if (min_ratio >= 8.0) {
+    return cv::IMREAD_REDUCED_COLOR_8;
+  } else if (min_ratio >= 4.0) {
+    return cv::IMREAD_REDUCED_COLOR_4;
+  } else if (min_ratio >= 2.0) {
+    return cv::IMREAD_REDUCED_COLOR_2;
+  } else {
+    return cv::IMREAD_COLOR;
+  }
+}
+
+cv::Size full_image_size(std::optional<cv::Size> const& header_size,
+                         cv::Size const& detect_size, int detect_scale)
+{
+  if (!header_size) {
+    return cv::Size(detect_size.width * detect_scale, detect_size.height * detect_scale);
+  }
+
+  if ((header_size->width > header_size->height) != (detect_size.width > detect_size.height)) {
+    return cv::Size(header_size->height, header_size->width);
+  }
+
+  return *header_size;
+}
+
+std::optional<Face> map_face(Face const& face, cv::Size const& from, cv::Size const& to)
+{
+  double const sx = static_cast<double>(to.width) / from.width;
+  double const sy = static_cast<double>(to.height) / from.height;
+  cv::Rect const bounds(0, 0, to.width, to.height);
+
+  cv::Rect const mapped = bounds & cv::Rect(static_cast<int>(face.rect.x * sx),
+                                            static_cast<int>(face.rect.y * sy),
+                                            static_cast<int>(face.rect.width * sx),
+                                            static_cast<int>(face.rect.height * sy));
+  if (mapped.empty()) {
+    return std::nullopt;
+  }
+
+  std::vector<cv::Point2f> landmarks;
+  landmarks.reserve(face.landmarks.size());
+  for (cv::Point2f const& point : face.landmarks) {
+    landmarks.emplace_back(static_cast<float>(point.x * sx), static_cast<float>(point.y * sy));
+  }
+  return Face{mapped, face.score, std::move(landmarks)};
+}
+
+std::vector<Face> map_faces(std::vector<Face> const& faces,
+                            cv::Size const& from, cv::Size const& to)
+{
+  std::vector<Face> result;
+  for (Face const& face : faces)
+  {
+    if (std::optional<Face> const mapped = map_face(face, from, to)) {
+      result.push_back(*mapped);
+    }
+  }
+  return result;
+}
+
+void crop_face(cv::Mat const& image, cv::Rect const& face, double inflate,
+               cv::Size const& output_size, cv::Mat& crop)
+{
+  int const inflate_x = static_cast<int>(face.width * inflate);
+  int const inflate_y = static_cast<int>(face.height * inflate);
+  cv::Rect const enlarged(face.x - inflate_x,
+                          face.y - inflate_y,
+                          face.width + inflate_x * 2,
+                          face.height + inflate_y * 2);
+
+  cv::Rect const inside = enlarged & cv::Rect(0, 0, image.cols, image.rows);
+  if (inside == enlarged) {
+    cv::resize(image(enlarged), crop, output_size);
+    return;
+  }
+
+  // crop, pad and resample in one pass: the warp maps every output
+  // pixel center back to the source like cv::resize() does, and its
+  // border mode fills the part beyond the image with black, so no
+  // padded copy of the crop is made
+  double const sx = static_cast<double>(enlarged.width) / output_size.width;
+  double const sy = static_cast<double>(enlarged.height) / output_size.height;
+  cv::Matx23d const to_source(sx, 0.0, enlarged.x + 0.5 * sx - 0.5,
+                              0.0, sy, enlarged.y + 0.5 * sy - 0.5);
+  cv::warpAffine(image, crop, to_source, output_size,
+                 cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+                 cv::BORDER_CONSTANT, cv::Scalar::all(0));
+}
+
+void align_face(cv::Mat const& image, std::vector<cv::Point2f> const& landmarks, double inflate,
+                cv::Size const& output_size, cv::Mat& crop)
+{
+  std::vector<dlib::point> parts;
+  parts.reserve(landmarks.size());
+  for (cv::Point2f const& point : landmarks) {
+    parts.emplace_back(std::lround(point.x), std::lround(point.y));
+  }
+
+  // the rectangle isn't used by get_face_chip_details(), only the parts
+  dlib::full_object_detection const shape(dlib::rectangle(), parts);
+  dlib::chip_details const details = dlib::get_face_chip_details(
+    shape, static_cast<unsigned long>(output_size.width), inflate);
+
+  // the chip is padded with black where it leaves the image
+  dlib::matrix<dlib::bgr_pixel> chip;
+  dlib::extract_image_chip(dlib::cv_image<dlib::bgr_pixel>(image), details, chip);
+  dlib::toMat(chip).copyTo(crop);
+}
+
+cv::Mat crop_faces(cv::Mat const& image, std::vector<Face> const& faces, double inflate,
+                   cv::Size const& output_size, cv::Mat& storage)
+{
+  // below that the thread handoff costs more than the resizes
+  constexpr size_t kParallelFaces = 8;
+
+  int const rows = static_cast<int>(faces.size()) * output_size.height;
+  if (storage.rows < rows || storage.cols != output_size.width || storage.type() != image.type()) {
+    storage.create(std::max(rows, storage.rows), output_size.width, image.type());
+  }
+  cv::Mat const crops = storage.rowRange(0, rows);
+
+  // cv::resize() writes into the views without reallocating, as they
+  // already have the output size and type
+  auto const crop_range = [&](cv::Range const& range) {
+    for (int idx = range.start; idx < range.end; ++idx) {
+      Face const& face = faces[static_cast<size_t>(idx)];
+      cv::Mat crop = crops.rowRange(idx * output_size.height, (idx + 1) * output_size.height);
+      if (face.landmarks.empty()) {
+        crop_face(image, face.rect, inflate, output_size, crop);
+      } else {
+        align_face(image, face.landmarks, inflate, output_size, crop);
+      }
+    }
+  };
+
+  cv::Range const all(0, static_cast<int>(faces.size()));
+  if (faces.size() >= kParallelFaces) {
+    cv::parallel_for_(all, crop_range);
+  } else {
+    crop_range(all);
+  }
+
+  return crops;
+}
+
+std::string_view file_extension(ImageFormat format)
+{
+  switch (format)
+  {
+    case ImageFormat::PNG: return ".png";
+    case ImageFormat::WEBP: return ".webp";
+    case ImageFormat::NPY: return ".npy";
+    default: return ".jpg";
+  }
+}
+
+std::vector<int> encode_params(Options const& opts)
+{
+  switch (opts.output_format)
+  {
+    case ImageFormat::PNG:
+      if (opts.png_compression) {
+        return { cv::IMWRITE_PNG_COMPRESSION, *opts.png_compression };
+      }
+      return {};
+
+    case ImageFormat::WEBP:
+      return { cv::IMWRITE_WEBP_QUALITY, opts.quality };
+
+    case ImageFormat::NPY:
+      return {};
+
+    default:
+      return { cv::IMWRITE_JPEG_QUALITY, opts.quality };
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
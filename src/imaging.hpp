@@ -0,0 +1,93 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_IMAGING_HPP
+#define HEADER_GESICHTOOL_IMAGING_HPP
+
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+
+#include "face.hpp"
+#include "options.hpp"
+
+namespace gesichtool {
+
+/** Wraps encoded image data for imdecode() without copying it */
+cv::Mat encoded_mat(std::span<unsigned char const> data);
+
+/** Returns the imdecode() flag that directly produces the detection
+    image, reduced by Options::detect_scale */
+int detect_decode_flag(Options const& opts);
+
+/** Returns the imdecode() flag for the color image the faces are
+    extracted from, reduced where the faces in full resolution
+    coordinates are large enough */
+int extract_decode_flag(Options const& opts, std::span<unsigned char const> data,
+                        std::vector<Face> const& faces);
+
+/** Returns the full resolution size of an image whose detection image
+    has 'detect_size'. The header size ignores the EXIF orientation
+    while the decoder applies it, so it is swapped when the decoded
+    image is rotated. */
+cv::Size full_image_size(std::optional<cv::Size> const& header_size,
+                         cv::Size const& detect_size, int detect_scale);
+
+/** Maps face rectangles detected in an image of size 'from' into the
+    coordinates of the same image at size 'to' and clips them to it,
+    faces that end up empty are dropped */
+std::optional<Face> map_face(Face const& face, cv::Size const& from, cv::Size const& to);
+std::vector<Face> map_faces(std::vector<Face> const& faces,
+                            cv::Size const& from, cv::Size const& to);
+
+/** Crops 'face', enlarged by 'inflate' times its size on every side,
+    out of 'image' and resizes it to 'output_size'. Parts beyond the
+    image border are padded with black. */
+void crop_face(cv::Mat const& image, cv::Rect const& face, double inflate,
+               cv::Size const& output_size, cv::Mat& crop);
+
+/** Cuts a face chip from 'image' that is rotated and scaled so the
+    5 or 68 'landmarks' of a dlib shape predictor end up at standard
+    positions, 'inflate' is the padding around the face. Needs a square
+    'output_size'. */
+void align_face(cv::Mat const& image, std::vector<cv::Point2f> const& landmarks, double inflate,
+                cv::Size const& output_size, cv::Mat& crop);
+
+/** Crops all 'faces' into one contiguous tensor of faces.size() crops
+    of 'output_size' stacked on top of each other, so crop i starts at
+    row i * output_size.height. The tensor is returned as a view into
+    'storage', which is only reallocated when it is too small. Images
+    with many faces are cropped with cv::parallel_for_(). Faces with
+    landmarks are aligned with align_face(), the others cropped with
+    crop_face(). */
+cv::Mat crop_faces(cv::Mat const& image, std::vector<Face> const& faces, double inflate,
+                   cv::Size const& output_size, cv::Mat& storage);
+
+std::string_view file_extension(ImageFormat format);
+
+/** Returns the imencode() parameters for Options::output_format, not
+    used for ImageFormat::NPY */
+std::vector<int> encode_params(Options const& opts);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
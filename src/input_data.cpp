@@ -0,0 +1,147 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "input_data.hpp"
+
+#include <fstream>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gesichtool {
+
+InputData::InputData() :
+  m_buffer(),
+  m_map(nullptr),
+  m_map_size(0)
+{
+}
+
+InputData::InputData(std::vector<unsigned char> buffer) :
+  m_buffer(std::move(buffer)),
+  m_map(nullptr),
+  m_map_size(0)
+{
+  m_buffer.clear();
+}
+
+InputData::InputData(InputData&& other) noexcept :
+  m_buffer(std::move(other.m_buffer)),
+  m_map(std::exchange(other.m_map, nullptr)),
+  m_map_size(std::exchange(other.m_map_size, 0))
+{
+}
+
+InputData&
+InputData::operator=(InputData&& other) noexcept
+{
+  if (this != &other) {
+    unmap();
+    m_buffer = std::move(other.m_buffer);
+    m_map = std::exchange(other.m_map, nullptr);
+    m_map_size = std::exchange(other.m_map_size, 0);
+  }
+  return *this;
+}
+
+InputData::~InputData()
+{
+  unmap();
+}
+
+bool
+InputData::load(std::filesystem::path const& path, bool map)
+{
+  unmap();
+  m_buffer.clear();
+
+  if (!map) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      return false;
+    }
+
+    in.seekg(0, std::ios::end);
+    std::streamoff const size = in.tellg();
+    in.seekg(0, std::ios::beg);
+    if (size <= 0) {
+      return false;
+    }
+
+    m_buffer.resize(static_cast<size_t>(size));
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(m_buffer.data()), size));
+  }
+
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  size_t const size = static_cast<size_t>(st.st_size);
+  void* const addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  // the whole file gets decoded, so have the kernel read it ahead
+  // instead of faulting it in page by page
+  ::madvise(addr, size, MADV_WILLNEED);
+
+  m_map = addr;
+  m_map_size = size;
+  return true;
+}
+
+std::span<unsigned char const>
+InputData::span() const
+{
+  if (m_map != nullptr) {
+    return std::span(static_cast<unsigned char const*>(m_map), m_map_size);
+  }
+  return m_buffer;
+}
+
+std::vector<unsigned char>
+InputData::take_buffer()
+{
+  unmap();
+  return std::move(m_buffer);
+}
+
+void
+InputData::unmap()
+{
+  if (m_map != nullptr) {
+    ::munmap(m_map, m_map_size);
+    m_map = nullptr;
+    m_map_size = 0;
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
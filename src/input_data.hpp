@@ -0,0 +1,67 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_INPUT_DATA_HPP
+#define HEADER_GESICHTOOL_INPUT_DATA_HPP
+
+#include <filesystem>
+#include <span>
+#include <vector>
+
+namespace gesichtool {
+
+/** The encoded bytes of an input file, either read into a buffer or
+    mapped read-only with mmap(), in which case the decoder works on
+    the page cache directly instead of on a copy. A mapped file must
+    not be truncated while in use, that would raise SIGBUS. */
+class InputData
+{
+public:
+  InputData();
+  explicit InputData(std::vector<unsigned char> buffer);
+  InputData(InputData&& other) noexcept;
+  InputData& operator=(InputData&& other) noexcept;
+  ~InputData();
+
+  /** Reads 'path' into the buffer or, with 'map', maps it, returns
+      false on failure or for empty files */
+  bool load(std::filesystem::path const& path, bool map);
+
+  std::span<unsigned char const> span() const;
+  size_t size() const { return span().size(); }
+
+  /** Unmaps the file and returns the read buffer for reuse */
+  std::vector<unsigned char> take_buffer();
+
+private:
+  void unmap();
+
+private:
+  std::vector<unsigned char> m_buffer;
+  void* m_map;
+  size_t m_map_size;
+
+public:
+  InputData(InputData const&) = delete;
+  InputData& operator=(InputData const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,294 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "input_source.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+
+#include "hash.hpp"
+
+namespace gesichtool {
+
+InputSource::InputSource(std::vector<std::filesystem::path> paths,
+                         std::vector<std::filesystem::path> lists,
+                         bool null_separated,
+                         InputShard shard) :
+  m_mutex(),
+  m_paths(std::move(paths)),
+  m_lists(std::move(lists)),
+  m_delimiter(null_separated ? '\0' : '\n'),
+  m_paths_idx(0),
+  m_lists_idx(0),
+  m_directory(),
+  m_list_file(),
+  m_list(nullptr),
+  m_shard(shard),
+  m_next_idx(0)
+{
+}
+
+std::optional<InputFile>
+InputSource::next()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  while (std::optional<std::filesystem::path> path = next_path())
+  {
+    if (m_shard.count > 1 &&
+        fnv1a(path->lexically_normal().native()) % m_shard.count != m_shard.index) {
+      continue;
+    }
+
+    return InputFile{m_next_idx++, std::move(*path)};
+  }
+
+  return std::nullopt;
+}
+
+size_t
+InputSource::produced()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_next_idx;
+}
+
+std::optional<std::filesystem::path>
+InputSource::next_path()
+{
+  while (true)
+  {
+    if (m_directory) {
+      if (std::optional<std::filesystem::path> path = next_from_directory()) {
+        return path;
+      }
+    } else if (m_list) {
+      if (std::optional<std::filesystem::path> path = next_from_list()) {
+        return path;
+      }
+    } else if (m_paths_idx < m_paths.size()) {
+      std::filesystem::path const& path = m_paths[m_paths_idx++];
+
+      std::error_code ec;
+      if (!std::filesystem::is_directory(path, ec)) {
+        return path;
+      }
+
+      std::filesystem::recursive_directory_iterator it(path, std::filesystem::directory_options::skip_permission_denied, ec);
+      if (ec) {
+        fmt::print(stderr, "error: failed to read directory {}: {}\n", path, ec.message());
+        continue;
+      }
+      m_directory.emplace(std::move(it));
+    } else if (m_lists_idx < m_lists.size()) {
+      std::filesystem::path const& list = m_lists[m_lists_idx++];
+      if (list == "-") {
+        m_list = &std::cin;
+      } else {
+        m_list_file = std::make_unique<std::ifstream>(list);
+        if (!*m_list_file) {
+          throw std::runtime_error(fmt::format("failed to open input list {}", list));
+        }
+        m_list = m_list_file.get();
+      }
+    } else {
+      return std::nullopt;
+    }
+  }
+}
+
+std::optional<std::filesystem::path>
+InputSource::next_from_directory()
+{
+  std::filesystem::recursive_directory_iterator& it = *m_directory;
+
+  while (it != std::filesystem::recursive_directory_iterator())
+  {
+    std::filesystem::directory_entry const entry = *it;
+
+    std::error_code ec;
+    it.increment(ec);
+    if (ec) {
+      fmt::print(stderr, "error: failed to read directory: {}\n", ec.message());
+      break;
+    }
+
+    if (entry.is_regular_file(ec) &&
+        (has_image_extension(entry.path()) || is_video_input(entry.path()))) {
+      return entry.path();
+    }
+  }
+
+  m_directory.reset();
+  return std::nullopt;
+}
+
+std::optional<std::filesystem::path>
+InputSource::next_from_list()
+{
+  std::string line;
+  while (std::getline(*m_list, line, m_delimiter))
+  {
+    if (m_delimiter == '\n' && !line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+
+    if (!line.empty()) {
+      return std::filesystem::path(line);
+    }
+  }
+
+  m_list = nullptr;
+  m_list_file.reset();
+  return std::nullopt;
+}
+
+namespace {
+
+void advise_willneed(std::filesystem::path const& path)
+{
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  ::close(fd);
+}
+
+} // namespace
+
+InputReadahead::InputReadahead(InputSource& source, size_t window, bool largest_first) :
+  m_mutex(),
+  m_source(source),
+  m_window(window),
+  m_largest_first(largest_first),
+  m_ahead()
+{
+}
+
+std::optional<InputFile>
+InputReadahead::next()
+{
+  // the hints open() the files, which can be a round trip on network
+  // storage, so they are given outside of the lock
+  std::vector<std::filesystem::path> hint;
+  std::optional<InputFile> result;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_ahead.size() < m_window)
+    {
+      std::optional<InputFile> input = m_source.next();
+      if (!input) {
+        break;
+      }
+
+      bool const video = is_video_input(input->path);
+      if (!video) {
+        hint.push_back(input->path);
+      }
+
+      uintmax_t cost = 0;
+      if (m_largest_first) {
+        // the file size is a stat() away, reading the header for the
+        // dimensions would cost as much as the hint itself
+        std::error_code ec;
+        cost = video ? std::numeric_limits<uintmax_t>::max() : std::filesystem::file_size(input->path, ec);
+        if (ec) {
+          cost = 0;
+        }
+      }
+      m_ahead.push_back(Ahead{std::move(*input), cost});
+    }
+
+    if (!m_ahead.empty()) {
+      // max_element() keeps the input order among equal costs
+      auto const it = m_largest_first
+        ? std::max_element(m_ahead.begin(), m_ahead.end(),
+                           [](Ahead const& lhs, Ahead const& rhs) { return lhs.cost < rhs.cost; })
+        : m_ahead.begin();
+      result = std::move(it->input);
+      m_ahead.erase(it);
+    }
+  }
+
+  for (std::filesystem::path const& path : hint) {
+    advise_willneed(path);
+  }
+
+  return result;
+}
+
+namespace {
+
+std::string lowercase_extension(std::filesystem::path const& path)
+{
+  std::string ext = path.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return ext;
+}
+
+} // namespace
+
+bool has_image_extension(std::filesystem::path const& path)
+{
+  static std::array<std::string_view, 14> const extensions = {
+    ".jpg", ".jpeg", ".jpe", ".png", ".webp", ".bmp", ".dib",
+    ".tif", ".tiff", ".jp2", ".pbm", ".pgm", ".ppm", ".pnm"
+  };
+
+  std::string const ext = lowercase_extension(path);
+  return std::find(extensions.begin(), extensions.end(), ext) != extensions.end();
+}
+
+bool is_video_input(std::filesystem::path const& path)
+{
+  static std::array<std::string_view, 11> const extensions = {
+    ".mp4", ".m4v", ".mkv", ".webm", ".avi", ".mov",
+    ".mpg", ".mpeg", ".ts", ".wmv", ".flv"
+  };
+
+  static std::array<std::string_view, 4> const prefixes = {
+    "/dev/video", "rtsp://", "http://", "https://"
+  };
+
+  std::string const& text = path.native();
+  for (std::string_view const prefix : prefixes) {
+    if (text.starts_with(prefix)) {
+      return true;
+    }
+  }
+
+  std::string const ext = lowercase_extension(path);
+  return std::find(extensions.begin(), extensions.end(), ext) != extensions.end();
+}
+
+} // namespace gesichtool
+
+/* EOF */
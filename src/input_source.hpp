@@ -0,0 +1,139 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_INPUT_SOURCE_HPP
+#define HEADER_GESICHTOOL_INPUT_SOURCE_HPP
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace gesichtool {
+
+/** Selects the inputs whose path hash modulo 'count' is 'index' */
+struct InputShard
+{
+  size_t index = 0;
+  size_t count = 1;
+};
+
+struct InputFile
+{
+  // running number in the order the files were produced
+  size_t idx;
+  std::filesystem::path path;
+};
+
+/** Produces the input files one at a time, so that arbitrarily long
+    inputs are processed with constant memory. Paths given directly
+    that are directories are searched recursively for image and video
+    files,
+    list files contain one path per line, or are NUL separated, and
+    "-" reads the list from stdin. With an InputShard only the paths
+    in that shard are produced, the hash doesn't depend on the order
+    of the inputs, so every process can read the same full listing.
+    Thread safe. */
+class InputSource
+{
+public:
+  InputSource(std::vector<std::filesystem::path> paths,
+              std::vector<std::filesystem::path> lists,
+              bool null_separated,
+              InputShard shard = {});
+
+  /** Returns std::nullopt once all inputs are exhausted */
+  std::optional<InputFile> next();
+
+  /** Number of files produced so far */
+  size_t produced();
+
+private:
+  std::optional<std::filesystem::path> next_path();
+  std::optional<std::filesystem::path> next_from_directory();
+  std::optional<std::filesystem::path> next_from_list();
+
+private:
+  std::mutex m_mutex;
+  std::vector<std::filesystem::path> m_paths;
+  std::vector<std::filesystem::path> m_lists;
+  char m_delimiter;
+  size_t m_paths_idx;
+  size_t m_lists_idx;
+  std::optional<std::filesystem::recursive_directory_iterator> m_directory;
+  std::unique_ptr<std::ifstream> m_list_file;
+  std::istream* m_list;
+  InputShard m_shard;
+  size_t m_next_idx;
+
+public:
+  InputSource(InputSource const&) = delete;
+  InputSource& operator=(InputSource const&) = delete;
+};
+
+/** Hands out the files of an InputSource while keeping the next
+    'window' of them announced to the kernel with
+    posix_fadvise(POSIX_FADV_WILLNEED), so that on slow or network
+    storage their reads are already in flight when a decode thread
+    gets to them.
+
+    With 'largest_first' the most expensive file of the window is
+    handed out next instead of the oldest, with videos ahead of all
+    images and images ordered by file size. Huge images then start
+    early instead of being the last ones to finish while the other
+    threads are idle. Thread safe. */
+class InputReadahead
+{
+public:
+  InputReadahead(InputSource& source, size_t window, bool largest_first = false);
+
+  /** Returns std::nullopt once all inputs are exhausted */
+  std::optional<InputFile> next();
+
+private:
+  struct Ahead
+  {
+    InputFile input;
+    uintmax_t cost;
+  };
+
+private:
+  std::mutex m_mutex;
+  InputSource& m_source;
+  size_t m_window;
+  bool m_largest_first;
+  std::deque<Ahead> m_ahead;
+
+public:
+  InputReadahead(InputReadahead const&) = delete;
+  InputReadahead& operator=(InputReadahead const&) = delete;
+};
+
+/** Whether 'path' has the extension of an image format OpenCV reads */
+bool has_image_extension(std::filesystem::path const& path);
+
+/** Whether 'path' is a video file, a capture device or a stream URL */
+bool is_video_input(std::filesystem::path const& path);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,143 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_MEMORY_BUDGET_HPP
+#define HEADER_GESICHTOOL_MEMORY_BUDGET_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+namespace gesichtool {
+
+/** Limits the amount of memory held by images in flight, acquire()
+    blocks until enough of the budget is free. A request larger than
+    the whole budget is admitted once nothing else is in use, so that
+    a single huge image can still be processed. */
+class MemoryBudget
+{
+public:
+  explicit MemoryBudget(size_t limit) :
+    m_limit(limit),
+    m_mutex(),
+    m_released(),
+    m_used(0),
+    m_closed(false)
+  {}
+
+  /** Returns false if the budget was closed while waiting */
+  bool acquire(size_t bytes)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_released.wait(lock, [this, bytes]{
+      return m_closed || m_used == 0 || m_used + bytes <= m_limit;
+    });
+    if (m_closed) {
+      return false;
+    }
+
+    m_used += bytes;
+    return true;
+  }
+
+  void release(size_t bytes)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_used -= bytes;
+    }
+    m_released.notify_all();
+  }
+
+  /** Wake up and fail all waiting acquire() calls */
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_released.notify_all();
+  }
+
+private:
+  size_t const m_limit;
+  std::mutex m_mutex;
+  std::condition_variable m_released;
+  size_t m_used;
+  bool m_closed;
+
+public:
+  MemoryBudget(MemoryBudget const&) = delete;
+  MemoryBudget& operator=(MemoryBudget const&) = delete;
+};
+
+/** Holds a part of a MemoryBudget and gives it back on destruction */
+class MemoryReservation
+{
+public:
+  MemoryReservation() :
+    m_budget(nullptr),
+    m_bytes(0)
+  {}
+
+  MemoryReservation(MemoryBudget& budget, size_t bytes) :
+    m_budget(&budget),
+    m_bytes(bytes)
+  {}
+
+  MemoryReservation(MemoryReservation&& other) noexcept :
+    m_budget(std::exchange(other.m_budget, nullptr)),
+    m_bytes(std::exchange(other.m_bytes, 0))
+  {}
+
+  MemoryReservation& operator=(MemoryReservation&& other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      m_budget = std::exchange(other.m_budget, nullptr);
+      m_bytes = std::exchange(other.m_bytes, 0);
+    }
+    return *this;
+  }
+
+  ~MemoryReservation()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    if (m_budget != nullptr) {
+      m_budget->release(m_bytes);
+      m_budget = nullptr;
+      m_bytes = 0;
+    }
+  }
+
+private:
+  MemoryBudget* m_budget;
+  size_t m_bytes;
+
+public:
+  MemoryReservation(MemoryReservation const&) = delete;
+  MemoryReservation& operator=(MemoryReservation const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
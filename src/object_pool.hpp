@@ -0,0 +1,73 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_OBJECT_POOL_HPP
+#define HEADER_GESICHTOOL_OBJECT_POOL_HPP
+
+#include <mutex>
+#include <vector>
+
+namespace gesichtool {
+
+/** Keeps released objects around for reuse, so buffers that are
+    passed between threads keep their allocation instead of going
+    back to malloc for every image. */
+template<typename T>
+class ObjectPool
+{
+public:
+  explicit ObjectPool(size_t max_objects) :
+    m_max_objects(max_objects),
+    m_mutex(),
+    m_objects()
+  {}
+
+  /** Returns a previously released object or a default constructed one */
+  T acquire()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_objects.empty()) {
+      return T();
+    }
+
+    T obj = std::move(m_objects.back());
+    m_objects.pop_back();
+    return obj;
+  }
+
+  void release(T obj)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_objects.size() < m_max_objects) {
+      m_objects.push_back(std::move(obj));
+    }
+  }
+
+private:
+  size_t const m_max_objects;
+  std::mutex m_mutex;
+  std::vector<T> m_objects;
+
+public:
+  ObjectPool(ObjectPool const&) = delete;
+  ObjectPool& operator=(ObjectPool const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
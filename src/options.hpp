@@ -0,0 +1,129 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_OPTIONS_HPP
+#define HEADER_GESICHTOOL_OPTIONS_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <opencv2/core/types.hpp>
+#include <opencv2/dnn.hpp>
+
+#include "input_source.hpp"
+
+namespace gesichtool {
+
+enum class Mode
+{
+  DLIB,
+  OPENCV,
+  DNN,
+  DLIB_CNN
+};
+
+enum class ImageFormat
+{
+  JPEG,
+  PNG,
+  WEBP,
+
+  // all crops of an image as one uncompressed array
+  NPY
+};
+
+enum class ArchiveFormat
+{
+  NONE,
+  TAR,
+  PACK
+};
+
+enum class Naming
+{
+  INDEX,
+  HASH
+};
+
+struct Options
+{
+  Mode mode = Mode::DLIB;
+  std::vector<std::filesystem::path> images = {};
+  std::vector<std::filesystem::path> input_lists = {};
+  bool null_separated = false;
+  InputShard shard = {};
+  bool mmap_input = false;
+  unsigned int readahead = 0;
+  bool largest_first = false;
+  std::filesystem::path output_directory = {};
+  cv::Size output_size = cv::Size(512, 512);
+  ImageFormat output_format = ImageFormat::JPEG;
+  int quality = 95;
+  std::optional<int> png_compression = {};
+  double inflate = 0.0;
+  std::filesystem::path align_model = {};
+  std::optional<int> dedup_distance = {};
+  std::filesystem::path dedup_index = {};
+  bool fsync = false;
+  bool no_crops = false;
+  std::filesystem::path detections_file = {};
+  std::filesystem::path cache_file = {};
+  ArchiveFormat archive = ArchiveFormat::NONE;
+  Naming naming = Naming::INDEX;
+  int fanout = 0;
+  uint64_t shard_size = uint64_t{1} << 30;
+  std::optional<cv::Size> min_size = cv::Size(512, 512);
+  std::optional<cv::Size> max_size = {};
+  bool verbose = false;
+  bool stats = false;
+  std::filesystem::path trace_file = {};
+  std::filesystem::path serve_socket = {};
+  unsigned int jobs = 0;
+  unsigned int decode_jobs = 0;
+  unsigned int encode_jobs = 0;
+  unsigned int write_jobs = 0;
+  unsigned int queue_size = 0;
+  unsigned int cv_threads = 0;
+  bool pin_threads = false;
+  int detect_scale = 1;
+  bool fast_dct = false;
+  size_t max_memory = 0;
+  unsigned int frame_stride = 1;
+  unsigned int detect_interval = 10;
+  bool prefilter = false;
+  int prefilter_scale = 2;
+  int min_neighbors = 3;
+  double scale_factor = 1.1;
+  double threshold = 0.0;
+  int upsample = 0;
+  std::filesystem::path dlib_cnn_model = {};
+  std::filesystem::path dnn_model = {};
+  std::filesystem::path dnn_config = {};
+  int dnn_backend = cv::dnn::DNN_BACKEND_DEFAULT;
+  int dnn_target = cv::dnn::DNN_TARGET_CPU;
+  cv::Size dnn_input_size = cv::Size(300, 300);
+  double confidence = 0.5;
+  unsigned int batch_size = 8;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,420 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "output_sink.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <unistd.h>
+
+namespace gesichtool {
+
+namespace {
+
+constexpr size_t kTarBlockSize = 512;
+
+uint64_t tar_padding(uint64_t size)
+{
+  return (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize;
+}
+
+// Writes 'value' as zero padded octal number into a tar header field
+// of 'field.size()' bytes, terminated by NUL
+void tar_octal(std::span<char> field, uint64_t value)
+{
+  std::string const text = fmt::format("{:0{}o}", value, field.size() - 1);
+  if (text.size() > field.size() - 1) {
+    throw std::runtime_error(fmt::format("value {} too large for tar header", value));
+  }
+  memcpy(field.data(), text.c_str(), text.size() + 1);
+}
+
+std::array<char, kTarBlockSize> make_tar_header(std::string const& name, uint64_t size)
+{
+  std::array<char, kTarBlockSize> header{};
+
+  // names longer than 100 characters are split into prefix and name
+  std::string prefix;
+  std::string basename = name;
+  if (name.size() > 100) {
+    std::string::size_type const slash = name.rfind('/', 155);
+    if (slash == std::string::npos || name.size() - slash - 1 > 100) {
+      throw std::runtime_error(fmt::format("name too long for tar: {}", name));
+    }
+    prefix = name.substr(0, slash);
+    basename = name.substr(slash + 1);
+  }
+
+  memcpy(header.data(), basename.data(), basename.size());
+  tar_octal(std::span(header).subspan(100, 8), 0644);
+  tar_octal(std::span(header).subspan(108, 8), 0);
+  tar_octal(std::span(header).subspan(116, 8), 0);
+  tar_octal(std::span(header).subspan(124, 12), size);
+  tar_octal(std::span(header).subspan(136, 12), static_cast<uint64_t>(time(nullptr)));
+  header[156] = '0';
+  memcpy(header.data() + 257, "ustar", 6);
+  memcpy(header.data() + 263, "00", 2);
+  memcpy(header.data() + 345, prefix.data(), prefix.size());
+
+  // the checksum is computed with the checksum field set to spaces
+  memset(header.data() + 148, ' ', 8);
+  unsigned int checksum = 0;
+  for (char const c : header) {
+    checksum += static_cast<unsigned char>(c);
+  }
+  tar_octal(std::span(header).subspan(148, 7), checksum);
+
+  return header;
+}
+
+// Drops '.' components and the trailing separator of 'out/', so the
+// directory is spelled the same as the paths built from it
+std::filesystem::path normalize_directory(std::filesystem::path const& directory)
+{
+  std::filesystem::path result = directory.lexically_normal();
+  if (!result.has_filename() && result.has_relative_path()) {
+    result = result.parent_path();
+  }
+  return result.empty() ? std::filesystem::path(".") : result;
+}
+
+void put_le(std::span<unsigned char> out, uint64_t value)
+{
+  for (unsigned char& byte : out) {
+    byte = static_cast<unsigned char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+} // namespace
+
+void
+OutputSink::wait_durable(std::function<void()> on_durable)
+{
+  if (on_durable) {
+    m_waiting.push_back(std::move(on_durable));
+  }
+}
+
+void
+OutputSink::made_durable()
+{
+  std::vector<std::function<void()>> const waiting = std::exchange(m_waiting, {});
+  for (auto const& on_durable : waiting) {
+    on_durable();
+  }
+}
+
+DirectorySink::DirectorySink(std::filesystem::path directory, bool sync) :
+  m_directory(normalize_directory(directory)),
+  m_sync(sync),
+  m_writer(sync),
+  m_dirty_directories()
+{
+}
+
+void
+DirectorySink::write(std::string const& name, std::span<unsigned char const> data,
+                     std::function<void()> on_durable)
+{
+  std::filesystem::path const subdirectory = std::filesystem::path(name).parent_path();
+  std::filesystem::path const path = m_directory / name;
+  bool ok = m_writer.write(path, data);
+
+  // names may contain subdirectories, which are only created once a
+  // write failed for their lack
+  if (!ok && errno == ENOENT && !subdirectory.empty()) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    ok = m_writer.write(path, data);
+
+    // the entries of the new directories are in their parents
+    if (ok && m_sync) {
+      std::filesystem::path dir = m_directory;
+      for (std::filesystem::path const& component : subdirectory) {
+        m_dirty_directories.insert(dir);
+        dir /= component;
+      }
+    }
+  }
+
+  if (!ok) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to write {}", path));
+  }
+
+  wait_durable(std::move(on_durable));
+  if (!m_sync) {
+    made_durable();
+    return;
+  }
+
+  // the writer fsync()s in batches, once it did the batch is durable
+  // together with its directory entries
+  m_dirty_directories.insert(path.parent_path());
+  if (m_writer.pending() == 0) {
+    sync_directories();
+    made_durable();
+  }
+}
+
+void
+DirectorySink::finish()
+{
+  m_writer.flush();
+  sync_directories();
+  made_durable();
+}
+
+void
+DirectorySink::sync_directories()
+{
+  for (std::filesystem::path const& dir : m_dirty_directories) {
+    sync_directory(dir);
+  }
+  m_dirty_directories.clear();
+}
+
+ShardedSink::ShardedSink(std::filesystem::path directory, std::string basename,
+                         std::string extension, uint64_t shard_size, bool sync) :
+  m_directory(std::move(directory)),
+  m_basename(std::move(basename)),
+  m_extension(std::move(extension)),
+  m_shard_size(shard_size),
+  m_sync(sync),
+  m_shard_idx(0),
+  m_file(nullptr),
+  m_offset(0)
+{
+}
+
+ShardedSink::~ShardedSink()
+{
+  if (m_file != nullptr) {
+    fclose(m_file);
+  }
+}
+
+void
+ShardedSink::write(std::string const& name, std::span<unsigned char const> data,
+                   std::function<void()> on_durable)
+{
+  uint64_t const size = record_size(name, data.size());
+  if (m_file == nullptr || (m_offset != 0 && m_offset + size > m_shard_size)) {
+    next_shard();
+  }
+
+  write_record(name, data);
+
+  // records are only complete once their shard is closed
+  wait_durable(std::move(on_durable));
+}
+
+void
+ShardedSink::finish()
+{
+  if (m_file != nullptr) {
+    close_shard();
+    shard_closed();
+  }
+}
+
+void
+ShardedSink::next_shard()
+{
+  if (m_file != nullptr) {
+    close_shard();
+    shard_closed();
+  }
+
+  // don't overwrite shards of an earlier run, e.g. one resumed with
+  // --cache, or of another process writing to the same directory
+  while (true) {
+    std::filesystem::path const shard_path =
+      m_directory / fmt::format("{}-{:05d}{}", m_basename, m_shard_idx, m_extension);
+    m_shard_idx += 1;
+    if (open_shard(shard_path)) {
+      break;
+    }
+  }
+}
+
+bool
+ShardedSink::open_shard(std::filesystem::path const& shard_path)
+{
+  // exclusive, so concurrent processes never open the same shard
+  m_file = fopen(shard_path.c_str(), "wbx");
+  if (m_file == nullptr) {
+    if (errno == EEXIST) {
+      return false;
+    }
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", shard_path));
+  }
+  m_offset = 0;
+  return true;
+}
+
+void
+ShardedSink::close_shard()
+{
+  FILE* const file = std::exchange(m_file, nullptr);
+
+  bool ok = fflush(file) == 0;
+  if (m_sync) {
+    ok = ok && fsync(fileno(file)) == 0;
+  }
+  int const err = errno;
+  ok = (fclose(file) == 0) && ok;
+
+  if (!ok) {
+    throw std::system_error(err, std::generic_category(), "failed to close shard");
+  }
+}
+
+void
+ShardedSink::shard_closed()
+{
+  if (m_sync) {
+    sync_directory(m_directory);
+  }
+  made_durable();
+}
+
+void
+ShardedSink::write_bytes(void const* data, size_t size)
+{
+  if (size != 0 && fwrite(data, size, 1, m_file) != 1) {
+    throw std::system_error(errno, std::generic_category(), "failed to write shard");
+  }
+  m_offset += size;
+}
+
+TarSink::TarSink(std::filesystem::path directory, std::string basename,
+                 uint64_t shard_size, bool sync) :
+  ShardedSink(std::move(directory), std::move(basename), ".tar", shard_size, sync)
+{
+}
+
+uint64_t
+TarSink::record_size(std::string const& /*name*/, size_t data_size) const
+{
+  return kTarBlockSize + data_size + tar_padding(data_size);
+}
+
+void
+TarSink::write_record(std::string const& name, std::span<unsigned char const> data)
+{
+  std::array<char, kTarBlockSize> const header = make_tar_header(name, data.size());
+  std::array<char, kTarBlockSize> const zeros{};
+
+  write_bytes(header.data(), header.size());
+  write_bytes(data.data(), data.size());
+  write_bytes(zeros.data(), tar_padding(data.size()));
+}
+
+void
+TarSink::close_shard()
+{
+  // end of archive marker
+  std::array<char, kTarBlockSize * 2> const zeros{};
+  write_bytes(zeros.data(), zeros.size());
+
+  ShardedSink::close_shard();
+}
+
+PackSink::PackSink(std::filesystem::path directory, std::string basename,
+                   uint64_t shard_size, bool sync) :
+  ShardedSink(std::move(directory), std::move(basename), ".pack", shard_size, sync),
+  m_index(nullptr)
+{
+}
+
+PackSink::~PackSink()
+{
+  if (m_index != nullptr) {
+    fclose(m_index);
+  }
+}
+
+uint64_t
+PackSink::record_size(std::string const& name, size_t data_size) const
+{
+  return 4 + name.size() + 8 + data_size;
+}
+
+void
+PackSink::write_record(std::string const& name, std::span<unsigned char const> data)
+{
+  std::array<unsigned char, 8> size_field;
+
+  put_le(std::span(size_field).first(4), name.size());
+  write_bytes(size_field.data(), 4);
+  write_bytes(name.data(), name.size());
+
+  put_le(size_field, data.size());
+  write_bytes(size_field.data(), 8);
+
+  uint64_t const data_offset = offset();
+  write_bytes(data.data(), data.size());
+
+  fmt::print(m_index, "{}\t{}\t{}\n", name, data_offset, data.size());
+}
+
+bool
+PackSink::open_shard(std::filesystem::path const& shard_path)
+{
+  if (!ShardedSink::open_shard(shard_path)) {
+    return false;
+  }
+
+  std::filesystem::path index_path = shard_path;
+  index_path.replace_extension(".idx");
+  m_index = fopen(index_path.c_str(), "w");
+  if (m_index == nullptr) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", index_path));
+  }
+  return true;
+}
+
+void
+PackSink::close_shard()
+{
+  ShardedSink::close_shard();
+
+  FILE* const index = std::exchange(m_index, nullptr);
+
+  bool ok = fflush(index) == 0;
+  if (sync()) {
+    ok = ok && fsync(fileno(index)) == 0;
+  }
+  int const err = errno;
+  ok = (fclose(index) == 0) && ok;
+
+  if (!ok) {
+    throw std::system_error(err, std::generic_category(), "failed to close shard index");
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
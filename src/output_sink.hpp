@@ -0,0 +1,180 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_OUTPUT_SINK_HPP
+#define HEADER_GESICHTOOL_OUTPUT_SINK_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <set>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "file_writer.hpp"
+
+namespace gesichtool {
+
+/** Destination for the encoded face images, each writer thread has
+    its own sink, so implementations don't need to be thread safe. */
+class OutputSink
+{
+public:
+  virtual ~OutputSink() = default;
+
+  /** Store 'data' under 'name', on error an exception is thrown.
+      'on_durable' is called from a later write() or finish() once the
+      data survives a crash: when it is in a file with plain output,
+      after the fsync() with 'sync' and after its shard was closed
+      with archives. */
+  virtual void write(std::string const& name, std::span<unsigned char const> data,
+                     std::function<void()> on_durable) = 0;
+
+  /** Complete all output, called once after the last write() */
+  virtual void finish() = 0;
+
+protected:
+  /** Hold 'on_durable' back until the next made_durable() */
+  void wait_durable(std::function<void()> on_durable);
+
+  /** Call the callbacks of everything written so far */
+  void made_durable();
+
+private:
+  std::vector<std::function<void()>> m_waiting = {};
+};
+
+/** Writes every face into its own file. With 'sync' the directories
+    that got new entries are fsync()ed along with the files, including
+    the subdirectories created for names like 'ab/face.jpg'. */
+class DirectorySink : public OutputSink
+{
+public:
+  DirectorySink(std::filesystem::path directory, bool sync);
+
+  void write(std::string const& name, std::span<unsigned char const> data,
+             std::function<void()> on_durable) override;
+  void finish() override;
+
+private:
+  std::filesystem::path m_directory;
+  bool m_sync;
+  FileWriter m_writer;
+
+  // directories with new entries since the last sync
+  std::set<std::filesystem::path> m_dirty_directories;
+
+private:
+  void sync_directories();
+};
+
+/** Base for sinks that pack the faces into a series of large shard
+    files, a new shard is started once the current one would grow
+    past 'shard_size'. Shards are named
+    '{basename}-{shard:05d}{extension}', existing shards are
+    skipped, also when another process creates them concurrently. */
+class ShardedSink : public OutputSink
+{
+public:
+  ShardedSink(std::filesystem::path directory, std::string basename,
+              std::string extension, uint64_t shard_size, bool sync);
+  ~ShardedSink() override;
+
+  void write(std::string const& name, std::span<unsigned char const> data,
+             std::function<void()> on_durable) override;
+  void finish() override;
+
+protected:
+  /** Number of bytes write_record() will produce */
+  virtual uint64_t record_size(std::string const& name, size_t data_size) const = 0;
+
+  virtual void write_record(std::string const& name, std::span<unsigned char const> data) = 0;
+
+  /** Returns false if 'shard_path' already exists */
+  virtual bool open_shard(std::filesystem::path const& shard_path);
+  virtual void close_shard();
+
+  /** Write raw bytes to the current shard */
+  void write_bytes(void const* data, size_t size);
+
+  /** Position in the current shard */
+  uint64_t offset() const { return m_offset; }
+
+  bool sync() const { return m_sync; }
+
+private:
+  void next_shard();
+
+  /** Sync the directory entry of the closed shard and release the
+      callbacks of its records */
+  void shard_closed();
+
+private:
+  std::filesystem::path m_directory;
+  std::string m_basename;
+  std::string m_extension;
+  uint64_t m_shard_size;
+  bool m_sync;
+  int m_shard_idx;
+  FILE* m_file;
+  uint64_t m_offset;
+
+public:
+  ShardedSink(ShardedSink const&) = delete;
+  ShardedSink& operator=(ShardedSink const&) = delete;
+};
+
+/** Writes the faces into POSIX ustar archives */
+class TarSink : public ShardedSink
+{
+public:
+  TarSink(std::filesystem::path directory, std::string basename,
+          uint64_t shard_size, bool sync);
+
+protected:
+  uint64_t record_size(std::string const& name, size_t data_size) const override;
+  void write_record(std::string const& name, std::span<unsigned char const> data) override;
+  void close_shard() override;
+};
+
+/** Writes the faces into '.pack' files made of records of the form
+    [u32le name_size][name][u64le data_size][data], with a '.idx' text
+    file next to each shard that lists 'name\toffset\tsize' for each
+    record, 'offset' pointing to the first byte of the data. */
+class PackSink : public ShardedSink
+{
+public:
+  PackSink(std::filesystem::path directory, std::string basename,
+           uint64_t shard_size, bool sync);
+  ~PackSink() override;
+
+protected:
+  uint64_t record_size(std::string const& name, size_t data_size) const override;
+  void write_record(std::string const& name, std::span<unsigned char const> data) override;
+  bool open_shard(std::filesystem::path const& shard_path) override;
+  void close_shard() override;
+
+private:
+  FILE* m_index;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,157 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_PIPELINE_HPP
+#define HEADER_GESICHTOOL_PIPELINE_HPP
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace gesichtool {
+
+/** A set of thread groups ('stages') that are connected by queues.
+    When a worker throws, all abort handlers are called, which are
+    expected to close the queues so that the other stages can wind
+    down, and the exception is rethrown from wait().
+
+    With 'pin_threads' every thread is bound to one of the CPUs the
+    process may run on, handed out round robin in the order the stages
+    are added. The threads then keep their caches, and the memory they
+    allocate themselves stays on their NUMA node. */
+class Pipeline
+{
+public:
+  explicit Pipeline(bool pin_threads = false) :
+    m_abort_mutex(),
+    m_abort_handlers(),
+    m_futures(),
+    m_cpus(pin_threads ? allowed_cpus() : std::vector<int>()),
+    m_next_cpu(0)
+  {}
+
+  ~Pipeline()
+  {
+    abort();
+  }
+
+  /** Register a function that unblocks waiting stages, called on error */
+  void on_abort(std::function<void()> handler)
+  {
+    std::lock_guard<std::mutex> lock(m_abort_mutex);
+    m_abort_handlers.push_back(std::move(handler));
+  }
+
+  /** Start 'jobs' threads running 'worker', the last thread to finish
+      calls 'on_finished', usually to close the stage's output queue */
+  template<typename Worker>
+  void add_stage(unsigned int jobs, Worker worker, std::function<void()> on_finished)
+  {
+    auto remaining = std::make_shared<std::atomic<unsigned int>>(jobs);
+    auto shared_worker = std::make_shared<Worker>(std::move(worker));
+    auto shared_on_finished = std::make_shared<std::function<void()>>(std::move(on_finished));
+
+    for (unsigned int job = 0; job < jobs; ++job)
+    {
+      int const cpu = m_cpus.empty() ? -1 : m_cpus[m_next_cpu++ % m_cpus.size()];
+      m_futures.push_back(std::async(std::launch::async, [this, remaining, shared_worker, shared_on_finished, cpu]{
+        if (cpu >= 0) {
+          pin_current_thread(cpu);
+        }
+
+        try {
+          (*shared_worker)();
+        } catch (...) {
+          abort();
+          if (remaining->fetch_sub(1) == 1) {
+            (*shared_on_finished)();
+          }
+          throw;
+        }
+
+        if (remaining->fetch_sub(1) == 1) {
+          (*shared_on_finished)();
+        }
+      }));
+    }
+  }
+
+  /** Wait for all stages to finish, rethrows the first error */
+  void wait()
+  {
+    for (auto& future : m_futures) {
+      future.get();
+    }
+  }
+
+private:
+  void abort()
+  {
+    std::lock_guard<std::mutex> lock(m_abort_mutex);
+    for (auto const& handler : m_abort_handlers) {
+      handler();
+    }
+  }
+
+  // the CPUs of the process affinity mask, which honors taskset and
+  // cpusets, so pinning never moves threads onto forbidden CPUs
+  static std::vector<int> allowed_cpus()
+  {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    return cpus;
+  }
+
+  // failing to pin only costs performance, so errors are ignored
+  static void pin_current_thread(int cpu)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+private:
+  std::mutex m_abort_mutex;
+  std::vector<std::function<void()>> m_abort_handlers;
+  std::vector<std::future<void>> m_futures;
+  std::vector<int> const m_cpus;
+  size_t m_next_cpu;
+
+public:
+  Pipeline(Pipeline const&) = delete;
+  Pipeline& operator=(Pipeline const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,129 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "result_cache.hpp"
+
+#include <cerrno>
+#include <fstream>
+#include <system_error>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <sys/stat.h>
+
+namespace gesichtool {
+
+namespace {
+
+// Strips the face count from a cache line, leaving the key
+std::optional<std::string> key_from_line(std::string const& line)
+{
+  // config, size and mtime
+  std::string::size_type pos = 0;
+  for (int field = 0; field < 3; ++field) {
+    pos = line.find('\t', pos);
+    if (pos == std::string::npos) {
+      return std::nullopt;
+    }
+    pos += 1;
+  }
+
+  std::string::size_type const faces_end = line.find('\t', pos);
+  if (faces_end == std::string::npos) {
+    return std::nullopt;
+  }
+
+  return line.substr(0, pos) + line.substr(faces_end + 1);
+}
+
+} // namespace
+
+ResultCache::ResultCache(std::filesystem::path const& cache_file, uint64_t config_hash) :
+  m_config_hash(config_hash),
+  m_mutex(),
+  m_keys(),
+  m_file(nullptr)
+{
+  {
+    std::ifstream in(cache_file);
+    std::string line;
+    while (std::getline(in, line)) {
+      // a truncated last line from an interrupted run is ignored
+      if (std::optional<std::string> key = key_from_line(line)) {
+        m_keys.insert(std::move(*key));
+      }
+    }
+  }
+
+  m_file = fopen(cache_file.c_str(), "a");
+  if (m_file == nullptr) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", cache_file));
+  }
+}
+
+ResultCache::~ResultCache()
+{
+  fclose(m_file);
+}
+
+std::optional<std::string>
+ResultCache::make_key(std::filesystem::path const& path) const
+{
+  std::error_code ec;
+  std::filesystem::path const absolute_path = std::filesystem::absolute(path, ec).lexically_normal();
+  if (ec) {
+    return std::nullopt;
+  }
+
+  struct stat st;
+  if (stat(absolute_path.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+
+  int64_t const mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+  return fmt::format("{:016x}\t{}\t{}\t{}", m_config_hash,
+                     static_cast<uint64_t>(st.st_size), mtime,
+                     absolute_path.native());
+}
+
+bool
+ResultCache::contains(std::string const& key) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_keys.contains(key);
+}
+
+void
+ResultCache::add(std::string const& key, size_t faces)
+{
+  // re-insert the face count in front of the path
+  std::string::size_type pos = 0;
+  for (int field = 0; field < 3; ++field) {
+    pos = key.find('\t', pos) + 1;
+  }
+  std::string const line = fmt::format("{}{}\t{}\n", key.substr(0, pos), faces, key.substr(pos));
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_keys.insert(key);
+  if (fwrite(line.data(), line.size(), 1, m_file) != 1 || fflush(m_file) != 0) {
+    throw std::system_error(errno, std::generic_category(), "failed to write result cache");
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
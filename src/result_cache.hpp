@@ -0,0 +1,125 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEADER_GESICHTOOL_RESULT_CACHE_HPP
+#define HEADER_GESICHTOOL_RESULT_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_set>
+
+namespace gesichtool {
+
+/** Records which input files have been completely processed, so that
+    a later run can skip them. Files are identified by path, size and
+    modification time together with a hash of the detector and output
+    configuration, changing either makes the file count as new.
+
+    The cache is an append-only text file with one line per file:
+
+      {config:016x}\t{size}\t{mtime}\t{faces}\t{path}
+
+    Each line is flushed as soon as the file is done, so an interrupted
+    run can be resumed. Thread safe. */
+class ResultCache
+{
+public:
+  ResultCache(std::filesystem::path const& cache_file, uint64_t config_hash);
+  ~ResultCache();
+
+  /** Returns the key for 'path' or std::nullopt if it can't be stat()ed */
+  std::optional<std::string> make_key(std::filesystem::path const& path) const;
+
+  bool contains(std::string const& key) const;
+
+  /** Mark the file as done */
+  void add(std::string const& key, size_t faces);
+
+private:
+  uint64_t const m_config_hash;
+  mutable std::mutex m_mutex;
+  std::unordered_set<std::string> m_keys;
+  FILE* m_file;
+
+public:
+  ResultCache(ResultCache const&) = delete;
+  ResultCache& operator=(ResultCache const&) = delete;
+};
+
+/** Adds an image to the cache once all of its faces have been made
+    durable by the output sinks, several at a time when they share an
+    output file. Inputs whose face count is only known at the end,
+    like videos, start without a count, announce their faces with
+    add_faces() and call finish() after the last one. */
+class PendingResult
+{
+public:
+  PendingResult(ResultCache& cache, std::string key, size_t faces) :
+    m_cache(cache),
+    m_key(std::move(key)),
+    m_faces(faces),
+    m_remaining(faces)
+  {}
+
+  PendingResult(ResultCache& cache, std::string key) :
+    m_cache(cache),
+    m_key(std::move(key)),
+    m_faces(0),
+    // held until finish(), so the entry isn't added while faces are
+    // still being found
+    m_remaining(1)
+  {}
+
+  /** Expect 'count' more faces, only before finish() */
+  void add_faces(size_t count)
+  {
+    m_faces += count;
+    m_remaining += count;
+  }
+
+  void finish()
+  {
+    faces_written(1);
+  }
+
+  void faces_written(size_t count)
+  {
+    if (m_remaining.fetch_sub(count) == count) {
+      m_cache.add(m_key, m_faces);
+    }
+  }
+
+private:
+  ResultCache& m_cache;
+  std::string const m_key;
+  std::atomic<size_t> m_faces;
+  std::atomic<size_t> m_remaining;
+
+public:
+  PendingResult(PendingResult const&) = delete;
+  PendingResult& operator=(PendingResult const&) = delete;
+};
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
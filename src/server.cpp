@@ -0,0 +1,426 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "server.hpp"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+
+#include "bounded_queue.hpp"
+#include "detections_writer.hpp"
+#include "face_extractor.hpp"
+#include "image_header.hpp"
+#include "imaging.hpp"
+
+namespace gesichtool {
+
+namespace {
+
+// larger requests are answered with an error and the connection closed
+constexpr uint32_t kMaxRequestSize = uint32_t{256} << 20;
+
+struct ServeRequest
+{
+  std::vector<unsigned char> data;
+  std::promise<std::vector<unsigned char>> response;
+  bool answered = false;
+};
+
+void respond(ServeRequest& request, std::vector<unsigned char> response)
+{
+  if (!request.answered) {
+    request.response.set_value(std::move(response));
+    request.answered = true;
+  }
+}
+
+bool read_all(int fd, unsigned char* data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t const count = ::read(fd, data, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= static_cast<size_t>(count);
+  }
+  return true;
+}
+
+bool write_all(int fd, std::span<unsigned char const> data)
+{
+  while (!data.empty())
+  {
+    // MSG_NOSIGNAL, a client going away must not SIGPIPE the server
+    ssize_t const count = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count <= 0) {
+      return false;
+    }
+    data = data.subspan(static_cast<size_t>(count));
+  }
+  return true;
+}
+
+void append_u32(std::vector<unsigned char>& out, uint32_t value)
+{
+  for (int shift = 0; shift < 32; shift += 8) {
+    out.push_back(static_cast<unsigned char>(value >> shift));
+  }
+}
+
+void append_chunk(std::vector<unsigned char>& out, std::span<unsigned char const> chunk)
+{
+  append_u32(out, static_cast<uint32_t>(chunk.size()));
+  out.insert(out.end(), chunk.begin(), chunk.end());
+}
+
+std::vector<unsigned char> error_response(std::string_view message)
+{
+  std::string const json = fmt::format(R"({{"error": {}}})", json_string(message));
+
+  std::vector<unsigned char> out;
+  append_chunk(out, std::span(reinterpret_cast<unsigned char const*>(json.data()), json.size()));
+  return out;
+}
+
+std::vector<unsigned char> faces_response(cv::Size const& image_size,
+                                          std::vector<ExtractedFace> const& faces)
+{
+  std::string json = fmt::format(R"({{"width": {}, "height": {}, "faces": [)",
+                                 image_size.width, image_size.height);
+  for (size_t idx = 0; idx < faces.size(); ++idx)
+  {
+    if (idx != 0) {
+      json += ", ";
+    }
+    json += json_face(faces[idx].face);
+  }
+  json += "]}";
+
+  std::vector<unsigned char> out;
+  append_chunk(out, std::span(reinterpret_cast<unsigned char const*>(json.data()), json.size()));
+  for (ExtractedFace const& face : faces) {
+    if (!face.encoded.empty()) {
+      append_chunk(out, face.encoded);
+    }
+  }
+  return out;
+}
+
+void serve_connection(int fd, BoundedQueue<ServeRequest>& queue)
+{
+  try
+  {
+    while (true)
+    {
+      unsigned char header[4];
+      if (!read_all(fd, header, sizeof(header))) {
+        break;
+      }
+
+      uint32_t const size = uint32_t{header[0]} | (uint32_t{header[1]} << 8) |
+        (uint32_t{header[2]} << 16) | (uint32_t{header[3]} << 24);
+      if (size == 0) {
+        break;
+      }
+
+      if (size > kMaxRequestSize) {
+        write_all(fd, error_response("request too large"));
+        break;
+      }
+
+      ServeRequest request{std::vector<unsigned char>(size), {}};
+      if (!read_all(fd, request.data.data(), size)) {
+        break;
+      }
+
+      std::future<std::vector<unsigned char>> response = request.response.get_future();
+      if (!queue.push(std::move(request))) {
+        break;
+      }
+
+      if (!write_all(fd, response.get())) {
+        break;
+      }
+    }
+  }
+  catch (std::exception const& err)
+  {
+    // nothing throws while a response is being written, so the error
+    // takes the place of the response the client waits for
+    fmt::print(stderr, "error: connection failed: {}\n", err.what());
+    write_all(fd, error_response(err.what()));
+  }
+}
+
+// The connection threads, kept so that serve() can wake them from
+// their reads and join them before it stops the workers. A connection's
+// socket is closed here only after its thread finished, so its number
+// can't be reused while shutdown() might still be called on it.
+class Connections
+{
+public:
+  Connections() :
+    m_mutex(),
+    m_connections()
+  {}
+
+  ~Connections()
+  {
+    shutdown();
+  }
+
+  void start(int fd, BoundedQueue<ServeRequest>& queue)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::erase_if(m_connections, [](Connection& connection) {
+      if (!connection.done) {
+        return false;
+      }
+      connection.thread.join();
+      ::close(connection.fd);
+      return true;
+    });
+
+    Connection& connection = m_connections.emplace_back(fd);
+    connection.thread = std::thread([&connection, &queue] {
+      serve_connection(connection.fd, queue);
+      connection.done = true;
+    });
+  }
+
+  // ends all connections, waiting for the ones blocked on a response
+  void shutdown()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (Connection& connection : m_connections) {
+      ::shutdown(connection.fd, SHUT_RDWR);
+    }
+
+    for (Connection& connection : m_connections) {
+      connection.thread.join();
+      ::close(connection.fd);
+    }
+    m_connections.clear();
+  }
+
+private:
+  struct Connection
+  {
+    explicit Connection(int fd_) : fd(fd_), done(false), thread() {}
+
+    int const fd;
+    std::atomic<bool> done;
+    std::thread thread;
+  };
+
+private:
+  std::mutex m_mutex;
+  std::list<Connection> m_connections;
+
+public:
+  Connections(Connections const&) = delete;
+  Connections& operator=(Connections const&) = delete;
+};
+
+void serve_batch(Options const& opts, FaceExtractor& extractor, std::vector<ServeRequest>& requests)
+{
+  std::vector<ServeRequest*> decoded;
+  std::vector<cv::Mat> images;
+  for (ServeRequest& request : requests)
+  {
+    try {
+      images.push_back(extractor.decode(request.data));
+      decoded.push_back(&request);
+    } catch (std::exception const& err) {
+      respond(request, error_response(err.what()));
+    }
+  }
+
+  if (images.empty()) {
+    return;
+  }
+
+  std::vector<std::vector<Face>> detected;
+  try {
+    detected = extractor.detect_batch(images);
+  } catch (std::exception const& err) {
+    for (ServeRequest* request : decoded) {
+      respond(*request, error_response(err.what()));
+    }
+    return;
+  }
+
+  for (size_t idx = 0; idx < decoded.size(); ++idx)
+  {
+    ServeRequest& request = *decoded[idx];
+    try {
+      std::vector<ExtractedFace> const faces = extractor.extract(request.data, images[idx],
+                                                                 detected[idx]);
+      cv::Size const image_size = full_image_size(read_image_size(request.data),
+                                                  images[idx].size(), opts.detect_scale);
+      respond(request, faces_response(image_size, faces));
+    } catch (std::exception const& err) {
+      respond(request, error_response(err.what()));
+    }
+  }
+}
+
+void serve_requests(Options const& opts, FaceExtractor& extractor, BoundedQueue<ServeRequest>& queue)
+{
+  while (std::optional<ServeRequest> first = queue.pop())
+  {
+    // like the pipeline's detect stage, batch whatever is already
+    // waiting instead of delaying the first request for more
+    std::vector<ServeRequest> requests;
+    requests.push_back(std::move(*first));
+    while (requests.size() < extractor.batch_size()) {
+      std::optional<ServeRequest> request = queue.try_pop();
+      if (!request) {
+        break;
+      }
+      requests.push_back(std::move(*request));
+    }
+
+    // an exception escaping the thread would terminate the server and
+    // leave the clients of the batch without a response
+    try {
+      serve_batch(opts, extractor, requests);
+    } catch (std::exception const& err) {
+      fmt::print(stderr, "error: failed to serve request: {}\n", err.what());
+      for (ServeRequest& request : requests) {
+        respond(request, error_response(err.what()));
+      }
+    }
+  }
+}
+
+int listen_unix(std::filesystem::path const& socket_path)
+{
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.native().size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error(fmt::format("socket path too long: {}", socket_path));
+  }
+  std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.native().size() + 1);
+
+  // a socket left behind by a previous server is replaced, other files
+  // are not touched
+  struct stat st;
+  if (::lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    ::unlink(socket_path.c_str());
+  }
+
+  int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), "failed to create socket");
+  }
+
+  if (::bind(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0 ||
+      ::listen(fd, SOMAXCONN) != 0)
+  {
+    int const err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::generic_category(),
+                            fmt::format("failed to listen on {}", socket_path));
+  }
+
+  return fd;
+}
+
+} // namespace
+
+void serve(Options const& opts, std::filesystem::path const& socket_path,
+           FaceDetectorFactory const& make_detector, unsigned int jobs)
+{
+  // loaded before listening, so a missing model fails serve() instead
+  // of a worker thread
+  std::vector<std::unique_ptr<FaceExtractor>> extractors;
+  for (unsigned int idx = 0; idx < jobs; ++idx) {
+    extractors.push_back(std::make_unique<FaceExtractor>(opts, make_detector));
+  }
+
+  int const listen_fd = listen_unix(socket_path);
+
+  BoundedQueue<ServeRequest> queue(jobs * 4);
+
+  std::vector<std::thread> workers;
+  for (std::unique_ptr<FaceExtractor> const& extractor : extractors) {
+    workers.emplace_back(serve_requests, std::cref(opts), std::ref(*extractor), std::ref(queue));
+  }
+
+  Connections connections;
+
+  fmt::print("listening on {}\n", socket_path);
+
+  int accept_errno = 0;
+  while (true)
+  {
+    int const fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      accept_errno = errno;
+      break;
+    }
+
+    connections.start(fd, queue);
+  }
+
+  // the connections first, they may still push requests for the workers
+  connections.shutdown();
+  queue.close();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  ::close(listen_fd);
+
+  throw std::system_error(accept_errno, std::generic_category(), "failed to accept connection");
+}
+
+} // namespace gesichtool
+
+/* EOF */
@@ -0,0 +1,56 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_SERVER_HPP
+#define HEADER_GESICHTOOL_SERVER_HPP
+
+#include <filesystem>
+
+#include "face_detector.hpp"
+#include "options.hpp"
+
+namespace gesichtool {
+
+/** Serves face extraction on a Unix stream socket, so repeated callers
+    don't pay for loading the detectors every time. A client sends any
+    number of requests over a connection, each answered in turn. All
+    integers are 32 bit little endian:
+
+    request:  size, encoded image
+    response: size, JSON, then size, encoded crop for every face unless
+              Options::no_crops is set
+
+    The JSON is {"width": 640, "height": 480, "faces": [{"x": 10,
+    "y": 20, "width": 100, "height": 100, "score": 0.8}]} in full
+    resolution coordinates, like the --detections records, or
+    {"error": "..."} without crops. A request
+    size of 0 closes the connection.
+
+    'jobs' threads each keep a detector from 'make_detector' and take
+    the requests of all connections from a shared queue, detectors with
+    a batch_size() above one process the waiting requests together.
+    The detectors are loaded before listening. Runs until accept()
+    fails, then shuts down the open connections and joins their
+    threads and the workers. */
+void serve(Options const& opts, std::filesystem::path const& socket_path,
+           FaceDetectorFactory const& make_detector, unsigned int jobs);
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */
@@ -0,0 +1,238 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "stats.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <string_view>
+#include <system_error>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <sys/resource.h>
+
+namespace gesichtool {
+
+namespace {
+
+std::string_view stage_name(Stage stage)
+{
+  switch (stage)
+  {
+    case Stage::READ: return "read";
+    case Stage::DECODE: return "decode";
+    case Stage::DETECT: return "detect";
+    case Stage::ALIGN: return "align";
+    case Stage::COLOR_DECODE: return "color decode";
+    case Stage::RESIZE: return "resize";
+    case Stage::DEDUP: return "dedup";
+    case Stage::ENCODE: return "encode";
+    case Stage::WRITE: return "write";
+  }
+  return "unknown";
+}
+
+std::string_view queue_name(QueueId queue)
+{
+  switch (queue)
+  {
+    case QueueId::DECODED: return "decoded";
+    case QueueId::DETECTED: return "detected";
+    case QueueId::CROPS: return "crops";
+  }
+  return "unknown";
+}
+
+// small and stable thread numbers read better in a trace than thread::id
+int current_thread()
+{
+  static std::atomic<int> next_thread = 0;
+  thread_local int const thread = next_thread++;
+  return thread;
+}
+
+} // namespace
+
+Stats::Stats(bool keep_events) :
+  m_start(Clock::now()),
+  m_keep_events(keep_events),
+  m_mutex(),
+  m_events(),
+  m_stages(),
+  m_queues(),
+  m_images(0),
+  m_faces(0),
+  m_duplicates(0)
+{
+}
+
+size_t
+Stats::bucket_index(uint64_t ns)
+{
+  if (ns < kSubBuckets) {
+    return static_cast<size_t>(ns);
+  }
+
+  // the top bit selects the power of two, the next four the sub bucket
+  size_t const exponent = static_cast<size_t>(std::bit_width(ns)) - 1;
+  size_t const sub = static_cast<size_t>(ns >> (exponent - 4)) & (kSubBuckets - 1);
+  return (exponent - 3) * kSubBuckets + sub;
+}
+
+uint64_t
+Stats::bucket_value(size_t idx)
+{
+  if (idx < kSubBuckets) {
+    return idx;
+  }
+
+  // the middle of the bucket
+  size_t const exponent = idx / kSubBuckets + 3;
+  uint64_t const width = uint64_t{1} << (exponent - 4);
+  return (kSubBuckets + idx % kSubBuckets) * width + width / 2;
+}
+
+void
+Stats::record(Stage stage, Clock::time_point begin, Clock::time_point end)
+{
+  uint64_t const ns = static_cast<uint64_t>(
+    std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()));
+
+  StageTimes& times = m_stages[static_cast<size_t>(stage)];
+  times.count += 1;
+  times.total_ns += ns;
+  times.buckets[bucket_index(ns)] += 1;
+
+  if (m_keep_events) {
+    int const thread = current_thread();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(Event{stage, thread, begin, end});
+  }
+}
+
+void
+Stats::sample_queue(QueueId queue, size_t depth)
+{
+  QueueDepth& stats = m_queues[static_cast<size_t>(queue)];
+  stats.samples += 1;
+  stats.total += depth;
+
+  uint64_t max = stats.max;
+  while (depth > max && !stats.max.compare_exchange_weak(max, depth)) {}
+}
+
+void
+Stats::print_summary()
+{
+  double const seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+
+  fmt::print("\nstatistics:\n");
+  fmt::print("  {} images in {:.2f}s, {:.1f} images/s, {} faces, {:.1f} faces/s\n",
+             m_images.load(), seconds, static_cast<double>(m_images) / seconds,
+             m_faces.load(), static_cast<double>(m_faces) / seconds);
+  if (m_duplicates != 0) {
+    fmt::print("  {} near-duplicate faces dropped\n", m_duplicates.load());
+  }
+
+  fmt::print("  {:<14} {:>9} {:>10} {:>10} {:>10} {:>10}\n",
+             "stage", "count", "total ms", "mean ms", "p50 ms", "p99 ms");
+  for (size_t stage = 0; stage < kStageCount; ++stage)
+  {
+    StageTimes const& times = m_stages[stage];
+    uint64_t const count = times.count;
+    if (count == 0) {
+      continue;
+    }
+
+    auto const percentile = [&times, count](uint64_t percent) {
+      uint64_t const rank = std::min(count - 1, count * percent / 100);
+      uint64_t seen = 0;
+      for (size_t idx = 0; idx < kBucketCount; ++idx) {
+        seen += times.buckets[idx];
+        if (seen > rank) {
+          return bucket_value(idx);
+        }
+      }
+      return bucket_value(kBucketCount - 1);
+    };
+
+    double const total_ms = static_cast<double>(times.total_ns) / 1e6;
+    fmt::print("  {:<14} {:>9} {:>10.1f} {:>10.3f} {:>10.3f} {:>10.3f}\n",
+               stage_name(static_cast<Stage>(stage)), count,
+               total_ms, total_ms / static_cast<double>(count),
+               static_cast<double>(percentile(50)) / 1e6,
+               static_cast<double>(percentile(99)) / 1e6);
+  }
+
+  fmt::print("  {:<14} {:>9} {:>10}\n", "queue", "mean", "max");
+  for (size_t queue = 0; queue < kQueueCount; ++queue)
+  {
+    QueueDepth const& stats = m_queues[queue];
+    if (stats.samples == 0) {
+      continue;
+    }
+
+    fmt::print("  {:<14} {:>9.1f} {:>10}\n",
+               queue_name(static_cast<QueueId>(queue)),
+               static_cast<double>(stats.total) / static_cast<double>(stats.samples),
+               stats.max.load());
+  }
+
+  struct rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    // ru_maxrss is in kilobytes on Linux
+    fmt::print("  peak RSS: {:.1f} MiB\n", static_cast<double>(usage.ru_maxrss) / 1024.0);
+  }
+}
+
+void
+Stats::write_trace(std::filesystem::path const& path)
+{
+  FILE* const file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to open {}", path));
+  }
+
+  auto const to_us = [this](Clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - m_start).count();
+  };
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  fmt::print(file, "{{\"traceEvents\": [\n");
+  for (size_t idx = 0; idx < m_events.size(); ++idx)
+  {
+    Event const& event = m_events[idx];
+    fmt::print(file, R"({{"name": "{}", "ph": "X", "pid": 1, "tid": {}, "ts": {}, "dur": {}}}{})",
+               stage_name(event.stage), event.thread,
+               to_us(event.begin), to_us(event.end) - to_us(event.begin),
+               idx + 1 < m_events.size() ? ",\n" : "\n");
+  }
+  fmt::print(file, "]}}\n");
+
+  if (fclose(file) != 0) {
+    throw std::system_error(errno, std::generic_category(), fmt::format("failed to write {}", path));
+  }
+}
+
+} // namespace gesichtool
+
+/* EOF */
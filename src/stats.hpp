@@ -0,0 +1,173 @@
+// gesichtool - Face Extraction Tool
+// Copyright (C) 2023 Ingo Ruhnke <grumbel@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef HEADER_GESICHTOOL_STATS_HPP
+#define HEADER_GESICHTOOL_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace gesichtool {
+
+enum class Stage
+{
+  READ,
+  DECODE,
+  DETECT,
+  ALIGN,
+  COLOR_DECODE,
+  RESIZE,
+  DEDUP,
+  ENCODE,
+  WRITE
+};
+
+enum class QueueId
+{
+  DECODED,
+  DETECTED,
+  CROPS
+};
+
+/** Collects per-stage timings, queue depths and counters of a run.
+    The timings go into a log-scale histogram per stage, so memory use
+    doesn't grow with the run and percentiles are accurate to about 3%.
+    With 'keep_events' every interval is kept as well, so the run can
+    be exported as Chrome trace events for chrome://tracing or
+    Perfetto. Thread safe. */
+class Stats
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit Stats(bool keep_events);
+
+  void record(Stage stage, Clock::time_point begin, Clock::time_point end);
+
+  /** Record the depth of a queue, sampled whenever an item is popped */
+  void sample_queue(QueueId queue, size_t depth);
+
+  void count_image() { m_images += 1; }
+  void count_faces(size_t faces) { m_faces += faces; }
+  void count_duplicates(size_t faces) { m_duplicates += faces; }
+
+  /** Print throughput, latency percentiles per stage, queue depths
+      and peak RSS to stdout */
+  void print_summary();
+
+  /** Write the recorded intervals as Chrome trace-event JSON, needs
+      'keep_events' */
+  void write_trace(std::filesystem::path const& path);
+
+private:
+  static constexpr size_t kStageCount = static_cast<size_t>(Stage::WRITE) + 1;
+  static constexpr size_t kQueueCount = static_cast<size_t>(QueueId::CROPS) + 1;
+
+  // durations in nanoseconds, below 16 one bucket per value, above 16
+  // buckets per power of two
+  static constexpr size_t kSubBuckets = 16;
+  static constexpr size_t kBucketCount = (64 - 3) * kSubBuckets;
+
+  struct Event
+  {
+    Stage stage;
+    int thread;
+    Clock::time_point begin;
+    Clock::time_point end;
+  };
+
+  struct StageTimes
+  {
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> total_ns = 0;
+    std::array<std::atomic<uint64_t>, kBucketCount> buckets = {};
+  };
+
+  struct QueueDepth
+  {
+    std::atomic<uint64_t> samples = 0;
+    std::atomic<uint64_t> total = 0;
+    std::atomic<uint64_t> max = 0;
+  };
+
+private:
+  static size_t bucket_index(uint64_t ns);
+  static uint64_t bucket_value(size_t idx);
+
+private:
+  Clock::time_point const m_start;
+  bool const m_keep_events;
+  std::mutex m_mutex;
+  std::vector<Event> m_events;
+  std::array<StageTimes, kStageCount> m_stages;
+  std::array<QueueDepth, kQueueCount> m_queues;
+  std::atomic<uint64_t> m_images;
+  std::atomic<uint64_t> m_faces;
+  std::atomic<uint64_t> m_duplicates;
+
+public:
+  Stats(Stats const&) = delete;
+  Stats& operator=(Stats const&) = delete;
+};
+
+/** Records the time from construction to destruction as 'stage', does
+    nothing when 'stats' is empty */
+class StageTimer
+{
+public:
+  StageTimer(std::optional<Stats>& stats, Stage stage) :
+    m_stats(stats),
+    m_stage(stage),
+    m_begin(stats ? Stats::Clock::now() : Stats::Clock::time_point())
+  {}
+
+  ~StageTimer()
+  {
+    if (m_stats) {
+      m_stats->record(m_stage, m_begin, Stats::Clock::now());
+    }
+  }
+
+private:
+  std::optional<Stats>& m_stats;
+  Stage const m_stage;
+  Stats::Clock::time_point const m_begin;
+
+public:
+  StageTimer(StageTimer const&) = delete;
+  StageTimer& operator=(StageTimer const&) = delete;
+};
+
+/** Returns fn() and records its run time as 'stage' */
+template<typename Fn>
+auto timed(std::optional<Stats>& stats, Stage stage, Fn&& fn)
+{
+  StageTimer const timer(stats, stage);
+  return fn();
+}
+
+} // namespace gesichtool
+
+#endif
+
+/* EOF */